@@ -0,0 +1,124 @@
+/*
+ * lunix-calibrate.c
+ *
+ * Upload the calibration of a single sensor node to the
+ * Lunix:TNG driver, through one of the device nodes of the
+ * measurement to calibrate, e.g. /dev/lunix3-temp.
+ *
+ * Computes the conversion table from the coefficients given,
+ * using the same formulas as mk_lookup_tables.c does for the
+ * built-in conversion.
+ *
+ * Must be run with root privilege.
+ *
+ */
+
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <sys/ioctl.h>
+
+#include "lunix-chrdev.h"
+
+#define ADC_FS		1023.0
+
+static int32_t table[LUNIX_CALIB_MAX];
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s <device> temp <a> <b> <c> [<R1>]\n"
+		"       %s <device> batt <Vref>\n"
+		"       %s <device> light <full scale>\n"
+		"       %s <device> reset\n\n"
+		"temp:  thermistor with 1/T = a + b ln(R) + c ln(R)^3,\n"
+		"       in series with R1 [default 10000 Ohm]\n"
+		"batt:  battery voltage against a reference of Vref Volts\n"
+		"light: linear, with full scale at raw value 65535\n"
+		"reset: restore the built-in conversion\n",
+		argv0, argv0, argv0, argv0);
+	exit(1);
+}
+
+/*
+ * One entry per 10-bit ADC value
+ */
+static uint32_t calib_temp(double a, double b, double c, double R1)
+{
+	unsigned int i;
+	double Rth, Kelvin_Inv, res;
+
+	for (i = 0; i <= ADC_FS; i++) {
+		Rth = (R1 * (ADC_FS - i)) / i;
+		Kelvin_Inv = a + b * log(Rth) + c * pow(log(Rth), 3);
+		res = (1.0 / Kelvin_Inv) - 272.15;
+		table[i] = (res * 1000 < -272150) ? -272150 : (int32_t)(res * 1000);
+	}
+	return i;
+}
+
+static uint32_t calib_batt(double vref)
+{
+	unsigned int i;
+
+	table[0] = 0;
+	for (i = 1; i <= ADC_FS; i++)
+		table[i] = (int32_t)(vref * (ADC_FS / i) * 1000);
+	return i;
+}
+
+/*
+ * One entry every 64 raw values, interpolated by the driver
+ */
+static uint32_t calib_light(double full_scale)
+{
+	unsigned int i;
+
+	for (i = 0; i < LUNIX_CALIB_MAX; i++)
+		table[i] = (int32_t)(i * 64 * full_scale * 1000 / 65535);
+	return i;
+}
+
+int main(int argc, char **argv)
+{
+	int fd;
+	struct lunix_calib calib;
+
+	if (argc < 3)
+		usage(argv[0]);
+
+	memset(&calib, 0, sizeof(calib));
+	calib.table = (uintptr_t)table;
+
+	if (!strcmp(argv[2], "temp") && (argc == 6 || argc == 7))
+		calib.cnt = calib_temp(atof(argv[3]), atof(argv[4]), atof(argv[5]),
+			argc == 7 ? atof(argv[6]) : 10000.0);
+	else if (!strcmp(argv[2], "batt") && argc == 4)
+		calib.cnt = calib_batt(atof(argv[3]));
+	else if (!strcmp(argv[2], "light") && argc == 4) {
+		calib.cnt = calib_light(atof(argv[3]));
+		calib.shift = 6;
+	} else if (!strcmp(argv[2], "reset") && argc == 3)
+		calib.cnt = 0;
+	else
+		usage(argv[0]);
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[1]);
+		exit(1);
+	}
+	if (ioctl(fd, LUNIX_IOC_SET_CALIB, &calib) < 0) {
+		perror("ioctl(LUNIX_IOC_SET_CALIB)");
+		exit(1);
+	}
+	close(fd);
+
+	return 0;
+}
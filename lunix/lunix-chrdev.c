@@ -20,15 +20,17 @@
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/uio.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
+#include <linux/err.h>
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
-#include "lunix-tables.h"
+#include "lunix-format.h"
 
 #define LUNIX_DRIVER_NAME "lunixTNG"
 
@@ -57,6 +59,29 @@ struct cdev lunix_chrdev_cdev;		/* linux/cdev.h */
  The return value will be zero on success or a negative error code on failure.
  */
 
+/*
+ * Does a new [converted] value pass the wakeup filter of this open file?
+ */
+static int lunix_chrdev_state_significant(struct lunix_chrdev_state_struct *state,
+	long value)
+{
+	struct lunix_filter *filter = &state->filter;
+
+	if (!filter->flags || !state->filter_primed)
+		return 1;
+
+	if ((filter->flags & LUNIX_FILTER_DEADBAND) &&
+	    abs(value - state->filter_last) >= filter->deadband)
+		return 1;
+	if ((filter->flags & LUNIX_FILTER_THRESHOLD) &&
+	    (value >= filter->threshold) != (state->filter_last >= filter->threshold))
+		return 1;
+	if ((filter->flags & LUNIX_FILTER_CHANGED) && value != state->filter_last)
+		return 1;
+
+	return 0;
+}
+
 /* TODO
  * Just a quick [unlocked] check to see if the cached
  * chrdev state needs to be updated from sensor measurements.
@@ -64,16 +89,162 @@ struct cdev lunix_chrdev_cdev;		/* linux/cdev.h */
 static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *state)
 {
 	struct lunix_sensor_struct *sensor;
+	struct lunix_msr_data_struct *msr;
 
 	WARN_ON ( !(sensor = state->sensor) );
-	/* ?
-	 * WHAT IS THIS
+	msr = sensor->msr_data[state->type];
+
+	/* In history mode, any sample past our cursor is news */
+	if (state->history)
+		return READ_ONCE(msr->head) != state->ring_pos;
+
+	/*
+	 * Otherwise, report the latest value on every update.
+	 * Serials increase on every update, so any difference
+	 * from the one cached means there is a new value.
 	 */
+	if (READ_ONCE(msr->head) == state->buf_serial)
+		return 0;
+
+	return lunix_chrdev_state_significant(state, READ_ONCE(msr->cooked));
+}
+
+/*
+ * Fetch the next sample past the ring cursor of this open file,
+ * without taking the sensor spinlock. A reader that has fallen more
+ * than LUNIX_MSR_RING_LEN samples behind skips to the oldest sample
+ * still in the ring. Returns 1 if a sample was fetched, 0 otherwise.
+ * Must be called with the character device state lock held.
+ */
+static int lunix_chrdev_ring_fetch(struct lunix_chrdev_state_struct *state,
+	struct lunix_msr_sample *sample)
+{
+	uint32_t seq, head, pos;
+	struct lunix_msr_data_struct *msr;
+
+	msr = state->sensor->msr_data[state->type];
+	do {
+		seq = lunix_msr_read_begin(msr);
+		head = msr->head;
+		pos = state->ring_pos;
+		if (head - pos > LUNIX_MSR_RING_LEN)
+			pos = head - LUNIX_MSR_RING_LEN;
+		if (pos != head)
+			*sample = msr->ring[pos & (LUNIX_MSR_RING_LEN - 1)];
+	} while (lunix_msr_read_retry(msr, seq));
+
+	if (pos == head)
+		return 0;
+
+	if (pos != state->ring_pos)
+		debug("reader fell behind, lost %u samples\n", pos - state->ring_pos);
+	state->ring_pos = pos + 1;
+	return 1;
+}
+
+/*
+ * Fetch the next sample this open file should report on: the next one
+ * in the ring in history mode, the latest one otherwise. Returns 1 if
+ * there is one the reader has not seen yet, 0 otherwise. Must be called
+ * with the character device state lock held.
+ */
+static int lunix_chrdev_state_fetch(struct lunix_chrdev_state_struct *state,
+	struct lunix_msr_sample *sample)
+{
+	int updated;
+	uint32_t seq;
+	struct lunix_sensor_struct *sensor;
+	struct lunix_msr_data_struct *msr;
 
 	/*
-	 * if last_update > timestamp =>> refresh = 1
+	 * Grab the raw data without taking the sensor spinlock,
+	 * so that we never hold up the line discipline. The page
+	 * seq count tells us whether we raced with an update.
 	 */
-	return sensor->msr_data[state->type]->last_update > state->buf_timestamp;
+
+	WARN_ON (!(sensor = state->sensor));
+
+	if (state->history)
+		return lunix_chrdev_ring_fetch(state, sample);
+
+	msr = sensor->msr_data[state->type];
+	do {
+		seq = lunix_msr_read_begin(msr);
+		/*
+		 * Any new data available?
+		 */
+		if ((updated = lunix_chrdev_state_needs_refresh(state))) {
+			sample->value = msr->values[0];
+			sample->cooked = msr->cooked;
+			sample->serial = msr->head;
+			sample->timestamp = msr->timestamp;
+		}
+	} while (lunix_msr_read_retry(msr, seq));
+
+	if (updated) {
+		state->buf_serial = sample->serial;
+		state->filter_last = sample->cooked;
+		state->filter_primed = 1;
+	}
+
+	return updated;
+}
+
+/*
+ * A reader sleeping on the sensor wait queue
+ */
+struct lunix_chrdev_waiter {
+	wait_queue_t wait;
+	struct lunix_chrdev_state_struct *state;
+};
+
+/*
+ * Called by wake_up() for every sleeping reader of the sensor.
+ * Readers whose filter rejects the new data are left asleep,
+ * instead of being scheduled only to go back to sleep.
+ */
+static int lunix_chrdev_wake_function(wait_queue_t *wait, unsigned mode, int sync, void *key)
+{
+	struct lunix_chrdev_waiter *waiter;
+
+	waiter = container_of(wait, struct lunix_chrdev_waiter, wait);
+	if (!lunix_chrdev_state_needs_refresh(waiter->state) &&
+	    !READ_ONCE(waiter->state->sensor->disconnected))
+		return 0;
+
+	return default_wake_function(wait, mode, sync, key);
+}
+
+/*
+ * Sleep until there is something new to report, or a signal arrives.
+ * Must be called without the character device state lock held.
+ */
+static int lunix_chrdev_wait(struct lunix_chrdev_state_struct *state)
+{
+	int ret;
+	wait_queue_head_t *wq = &state->sensor->wq;
+	struct lunix_chrdev_waiter waiter = { .state = state };
+
+	init_waitqueue_func_entry(&waiter.wait, lunix_chrdev_wake_function);
+	waiter.wait.private = current;
+	add_wait_queue(wq, &waiter.wait);
+
+	ret = 0;
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (lunix_chrdev_state_needs_refresh(state) ||
+		    READ_ONCE(state->sensor->disconnected))
+			break;
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		schedule();
+	}
+
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(wq, &waiter.wait);
+	return ret;
 }
 
 /* TODO:
@@ -85,62 +256,33 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 {
 	int ret; /* return value */
 	
-	long *lkpTables[] = { lookup_voltage, lookup_temperature, lookup_light };
-	
-	struct lunix_sensor_struct *sensor;
-	unsigned long flags; 
-		
 	int updated;
 
 	uint32_t _data;
-	uint32_t _timestamp;
+	uint32_t _serial;
+	uint64_t _timestamp;
+	int32_t __data;
+	struct lunix_msr_sample sample;
 
-	long __data;
-
-	long dec, frac;		/* decimal, fractional part */
-	unsigned char sign;	/* positive (+), negative (-) */
+	int len;
 	
-	debug("entering state_update()\n");
-
-	/*
-	 * Grab the raw data quickly, hold the
-	 * spinlock for as little as possible.
-	 */
-
-	WARN_ON (!(sensor = state->sensor));
-
-	/* ? =>> What should we use?
-	 * down_interruptible ?
-	 * spin_lock_irqsave  ?
-	 */
-	spin_lock_irqsave(&sensor->lock, flags);
-	/* ========== Critical Section */
-
-	/* ? */
-	/* Why use spinlocks? See LDD3, p. 119 */
-
-	/*
-	 * Any new data available?
-	 */
-	if ((updated = lunix_chrdev_state_needs_refresh(state))) {
-		/* grab data ? WHAT IS STORED IN VALUES[] ? */
-		_data = sensor->msr_data[state->type]->values[0];
-		_timestamp = sensor->msr_data[state->type]->last_update;
+	if ((updated = lunix_chrdev_state_fetch(state, &sample))) {
+		_data = sample.value;
+		__data = sample.cooked;
+		_serial = sample.serial;
+		_timestamp = sample.timestamp;
 	}
 
-	/* ========================================== */
-	spin_unlock_irqrestore(&sensor->lock, flags);
-
 	/* ? */
 
 	/*
 	 * Now we can take our time to format them,
-	 * holding only the private state semaphore
+	 * holding only the private state mutex.
+	 * The longest line [STAMPED] is 10 + 1 + 20 + 1 + 16 characters.
 	 */
 	ret = 0;
+	len = 0;
 	if (updated) {
-		__data = lkpTables[state->type][_data];
-
 		switch (state->mode) {
 			case RAW:
 				state->buf_data[0] = _data;
@@ -148,14 +290,18 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 				state->buf_lim = 1;
 				break;
 				/* RAW */
+			case STAMPED:
+				/* serial and timestamp, followed by the COOKED value */
+				len += lunix_chrdev_utoa(state->buf_data + len, _serial, 1);
+				state->buf_data[len++] = ' ';
+				len += lunix_chrdev_utoa(state->buf_data + len, _timestamp, 1);
+				state->buf_data[len++] = ' ';
+				/* fall through */
 			case COOKED:
-				sign = (__data >= 0) ? '+' : '-';
-			 	dec = __data / 1000;
-				frac = __data % 1000;
-
-				/* give floating point representation */
-				snprintf(state->buf_data, LUNIX_CHRDEV_BUFSZ, "%c%ld.%ld\n", sign, dec, frac);
-				state->buf_lim = strnlen(state->buf_data, LUNIX_CHRDEV_BUFSZ) + 1;
+				/* give fixed point representation */
+				len += lunix_chrdev_format_cooked(state->buf_data + len, __data,
+					state->precision);
+				state->buf_lim = len;
 
 				/* ensure null terminated strings */
 				state->buf_data[state->buf_lim] = '\0';
@@ -182,15 +328,15 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 	}
 	else {
 		/* Internal Error
-		 * -ERESTARTSYS is connected to the concept of a restartable system call.
-		 * A restartable system call is one that can be transparently re-executed by the kernel when there is some interruption.
+		 * Nothing was ever formatted. Not -ERESTARTSYS: read_iter()
+		 * passes this on to userspace, which would only restart the
+		 * call to hit the same error again.
 		 */
-		ret = -ERESTARTSYS;
+		ret = -EIO;
 		goto out;
 	}
 
 out:
-	debug("leaving update(), with ret = %d\n", ret);
 	return ret;
 }
 
@@ -198,6 +344,8 @@ out:
  * Implementation of file operations
  * for the Lunix character device
  *************************************/
+static struct file_operations lunix_chrdev_msg_fops;
+
 // TODO
 static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 {
@@ -206,17 +354,19 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 
 	/* pvt state of device */
 	struct lunix_chrdev_state_struct *state;
+	struct lunix_sensor_struct *sensor;
 
 	/* get minor number */
 	dev_t _minor_ = iminor(inode);
 
 	/* device type */
-	int type = _minor_ & 0xf;   /* Battery, Temperature or Light measurement */
+	int type = _minor_ & 0x7;   /* Battery, Temperature or Light measurement, Health or Routing packets */
 
 	/* lookup tables */
 
 	// enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
-	if (type >= N_LUNIX_MSR) {
+	// followed by enum lunix_msg_enum { HEALTH = 0, ROUTE, N_LUNIX_MSG };
+	if (type >= N_LUNIX_MSR + N_LUNIX_MSG) {
 		ret = -ENODEV;  /* NO SUCH DEVICE */
 		goto out;
 	}
@@ -229,8 +379,22 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 
 	/*
 	 * Associate this open file with the relevant sensor based on
-	 * the minor number of the device node [/dev/sensor<NO>-<TYPE>]
+	 * the minor number of the device node [/dev/sensor<NO>-<TYPE>].
+	 * Only the administrator may open a node not heard from yet,
+	 * creating its sensor: any user could otherwise use up all of
+	 * lunix_sensor_cnt by opening device nodes, locking real nodes out.
 	 */
+	sensor = lunix_sensor_lookup((_minor_ >> 3) + 1);
+	if (!sensor) {
+		ret = -ENODEV;
+		if (!capable(CAP_SYS_ADMIN))
+			goto out;
+		sensor = lunix_sensor_get((_minor_ >> 3) + 1);
+		if (IS_ERR(sensor)) {
+			ret = PTR_ERR(sensor);
+			goto out;
+		}
+	}
 
 	/* Allocate a new Lunix character device private state structure *
 	 * Consider using vmalloc()
@@ -244,15 +408,27 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 	}
 
     /* parse info into state struct */
-	state->type = type; // type of measurement
-	state->sensor = &lunix_sensors[_minor_ >> 3];
+	state->sensor = sensor;
 	state->buf_lim = 1; /* ? */
+	state->buf_serial = 0;
+	state->buf_timestamp = 0;
+	state->history = 0;
+	state->ring_pos = 0;
+	memset(&state->filter, 0, sizeof(state->filter));
+	state->filter_primed = 0;
 
 	/* process raw data =>> COOKED */
 	state->mode = COOKED;
+	state->precision = LUNIX_PRECISION_MAX;
 
-	/* initialize semaphore =>> mutex */
-	sema_init(&state->lock, 1);
+	mutex_init(&state->lock);
+
+	/* Health and routing packets are read through their own operations */
+	if (type >= N_LUNIX_MSR) {
+		state->msg = type - N_LUNIX_MSR;
+		replace_fops(filp, &lunix_chrdev_msg_fops);
+	} else
+		state->type = type; // type of measurement
 
 	/* preserve state information across syscalls =>> needs to be freed */
 	filp->private_data = (struct lunix_chrdev_state_struct *)state;
@@ -293,25 +469,379 @@ static int lunix_chrdev_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
-// TODO
+/*
+ * Copy the raw values of the sensors to userspace in one go,
+ * without taking any sensor spinlock.
+ */
+static long lunix_chrdev_ioctl_snapshot(struct lunix_snapshot __user *usnap)
+{
+	uint32_t i, n, cnt, seq;
+	uint16_t first;
+	struct lunix_snapshot snap;
+	struct lunix_msr_data_struct *msr;
+	struct lunix_sensor_struct *sensors[LUNIX_SNAPSHOT_CHUNK];
+	struct lunix_snapshot_entry entries[LUNIX_SNAPSHOT_CHUNK];
+	struct lunix_snapshot_entry __user *uentries;
+
+	if (copy_from_user(&snap, usnap, sizeof(snap)))
+		return -EFAULT;
+
+	if (snap.first > LUNIX_MAX_NODES)
+		return -EINVAL;
+
+	/*
+	 * Walk the sensors in order of node id, a few at a time
+	 */
+	uentries = (struct lunix_snapshot_entry __user *)(unsigned long)snap.entries;
+	first = snap.first;
+	for (cnt = 0; cnt < snap.cnt; cnt += n) {
+		n = min_t(uint32_t, snap.cnt - cnt, LUNIX_SNAPSHOT_CHUNK);
+		n = lunix_sensor_gang_lookup(sensors, first, n);
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			entries[i].nodeid = sensors[i]->nodeid;
+			entries[i].__pad = 0;
+
+			msr = sensors[i]->msr_data[BATT];
+			do {
+				seq = lunix_msr_read_begin(msr);
+				entries[i].batt = msr->values[0];
+				entries[i].batt_cooked = msr->cooked;
+				entries[i].last_update = msr->last_update;
+				entries[i].serial = msr->head;
+				entries[i].timestamp = msr->timestamp;
+			} while (lunix_msr_read_retry(msr, seq));
+
+			msr = sensors[i]->msr_data[TEMP];
+			do {
+				seq = lunix_msr_read_begin(msr);
+				entries[i].temp = msr->values[0];
+				entries[i].temp_cooked = msr->cooked;
+			} while (lunix_msr_read_retry(msr, seq));
+
+			msr = sensors[i]->msr_data[LIGHT];
+			do {
+				seq = lunix_msr_read_begin(msr);
+				entries[i].light = msr->values[0];
+				entries[i].light_cooked = msr->cooked;
+			} while (lunix_msr_read_retry(msr, seq));
+		}
+
+		if (copy_to_user(uentries + cnt, entries, n * sizeof(*entries)))
+			return -EFAULT;
+
+		if (sensors[n - 1]->nodeid == LUNIX_MAX_NODES) {
+			cnt += n;
+			break;
+		}
+		first = sensors[n - 1]->nodeid + 1;
+	}
+
+	snap.cnt = cnt;
+	if (copy_to_user(usnap, &snap, sizeof(snap)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Switch an open file in or out of history mode. When switched on,
+ * reading starts from the oldest sample still held in the ring.
+ */
+static long lunix_chrdev_ioctl_history(struct lunix_chrdev_state_struct *state,
+	int __user *uarg)
+{
+	int enable;
+	uint32_t head;
+
+	if (get_user(enable, uarg))
+		return -EFAULT;
+
+	if (mutex_lock_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	state->history = !!enable;
+	if (state->history) {
+		head = READ_ONCE(state->sensor->msr_data[state->type]->head);
+		state->ring_pos = head - min_t(uint32_t, head, LUNIX_MSR_RING_LEN);
+	}
+
+	mutex_unlock(&state->lock);
+	return 0;
+}
+
+/*
+ * Select the format in which values are reported by read()
+ */
+static long lunix_chrdev_ioctl_set_mode(struct lunix_chrdev_state_struct *state,
+	int __user *uarg)
+{
+	int mode;
+
+	if (get_user(mode, uarg))
+		return -EFAULT;
+
+	switch (mode) {
+		case RAW:
+		case COOKED:
+		case STAMPED:
+		case BINARY:
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&state->lock))
+		return -ERESTARTSYS;
+	state->mode = mode;
+	mutex_unlock(&state->lock);
+
+	return 0;
+}
+
+/*
+ * Set the number of decimals of the values formatted as text
+ */
+static long lunix_chrdev_ioctl_set_precision(struct lunix_chrdev_state_struct *state,
+	int __user *uarg)
+{
+	int prec;
+
+	if (get_user(prec, uarg))
+		return -EFAULT;
+
+	if (prec < 0 || prec > LUNIX_PRECISION_MAX)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&state->lock))
+		return -ERESTARTSYS;
+	state->precision = prec;
+	mutex_unlock(&state->lock);
+
+	return 0;
+}
+
+/*
+ * Set the wakeup filter of an open file
+ */
+static long lunix_chrdev_ioctl_set_filter(struct lunix_chrdev_state_struct *state,
+	struct lunix_filter __user *ufilter)
+{
+	struct lunix_filter filter;
+
+	if (copy_from_user(&filter, ufilter, sizeof(filter)))
+		return -EFAULT;
+
+	if (filter.flags & ~(LUNIX_FILTER_DEADBAND | LUNIX_FILTER_THRESHOLD |
+			     LUNIX_FILTER_CHANGED))
+		return -EINVAL;
+	if (filter.deadband < 0)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&state->lock))
+		return -ERESTARTSYS;
+	state->filter = filter;
+	mutex_unlock(&state->lock);
+
+	return 0;
+}
+
+/*
+ * Upload a calibration table for the measurement of this device node,
+ * for all readers of the sensor.
+ */
+static long lunix_chrdev_ioctl_set_calib(struct lunix_chrdev_state_struct *state,
+	struct lunix_calib __user *ucalib)
+{
+	uint32_t i;
+	struct lunix_calib calib;
+	struct lunix_calib_table *table;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&calib, ucalib, sizeof(calib)))
+		return -EFAULT;
+
+	if (calib.cnt > LUNIX_CALIB_MAX || calib.shift > 16)
+		return -EINVAL;
+
+	table = NULL;
+	if (calib.cnt) {
+		table = kmalloc(sizeof(*table) + calib.cnt * sizeof(table->table[0]), GFP_KERNEL);
+		if (!table)
+			return -ENOMEM;
+		table->cnt = calib.cnt;
+		table->shift = calib.shift;
+		if (copy_from_user(table->table, (void __user *)(unsigned long)calib.table,
+				   calib.cnt * sizeof(table->table[0]))) {
+			kfree(table);
+			return -EFAULT;
+		}
+		for (i = 0; i < calib.cnt; i++)
+			if (table->table[i] < -LUNIX_CALIB_RANGE ||
+			    table->table[i] > LUNIX_CALIB_RANGE) {
+				kfree(table);
+				return -EINVAL;
+			}
+	}
+
+	lunix_sensor_set_calib(state->sensor, state->type, table);
+	return 0;
+}
+
+/*
+ * Report the running statistics of the measurement of this device node,
+ * optionally restarting them.
+ */
+static long lunix_chrdev_ioctl_stats(struct lunix_chrdev_state_struct *state,
+	struct lunix_msr_stats __user *ustats, int reset)
+{
+	struct lunix_msr_stats stats;
+
+	lunix_sensor_read_stats(state->sensor, state->type, &stats, reset);
+
+	if (copy_to_user(ustats, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
+
 static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	/* Why? */
-	return -EINVAL;
+	long ret;
+	struct lunix_chrdev_state_struct *state;
+
+	state = (struct lunix_chrdev_state_struct *)filp->private_data;
+	WARN_ON(!state);
+
+	debug("entering ioctl(), cmd = %u\n", cmd);
+
+	if (_IOC_TYPE(cmd) != LUNIX_IOC_MAGIC || _IOC_NR(cmd) > LUNIX_IOC_MAXNR)
+		return -ENOTTY;
+
+	switch (cmd) {
+		case LUNIX_IOC_SNAPSHOT:
+			ret = lunix_chrdev_ioctl_snapshot((struct lunix_snapshot __user *)arg);
+			break;
+
+		case LUNIX_IOC_HISTORY:
+			ret = lunix_chrdev_ioctl_history(state, (int __user *)arg);
+			break;
+
+		case LUNIX_IOC_SET_MODE:
+			ret = lunix_chrdev_ioctl_set_mode(state, (int __user *)arg);
+			break;
+
+		case LUNIX_IOC_GET_STATS:
+		case LUNIX_IOC_TAKE_STATS:
+			ret = lunix_chrdev_ioctl_stats(state, (struct lunix_msr_stats __user *)arg,
+						       cmd == LUNIX_IOC_TAKE_STATS);
+			break;
+
+		case LUNIX_IOC_SET_FILTER:
+			ret = lunix_chrdev_ioctl_set_filter(state, (struct lunix_filter __user *)arg);
+			break;
+
+		case LUNIX_IOC_SET_CALIB:
+			ret = lunix_chrdev_ioctl_set_calib(state, (struct lunix_calib __user *)arg);
+			break;
+
+		case LUNIX_IOC_SET_PRECISION:
+			ret = lunix_chrdev_ioctl_set_precision(state, (int __user *)arg);
+			break;
+
+		default:
+			ret = -ENOTTY;
+			break;
+	}
+
+	debug("leaving ioctl(), with ret = %ld\n", ret);
+	return ret;
 }
 
-// TODO
-/*      - copy reference from filp
- *      - read up to cnt bytes of data
- *      - save data into buffer
- *      - ?
+/*
+ * read() in BINARY mode: report as many samples as fit in the user
+ * buffer as fixed-size records, sleeping only if there is none yet.
  */
-static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
+static ssize_t lunix_chrdev_read_records(struct file *filp, struct iov_iter *to)
 {
 	ssize_t ret;
-	size_t  remaining_data;
+	size_t max, done, n;
+	struct lunix_msr_sample sample;
+	struct lunix_chrdev_state_struct *state;
+	struct lunix_record recs[LUNIX_CHRDEV_RECS];
+
+	state = (struct lunix_chrdev_state_struct *)filp->private_data;
+
+	max = iov_iter_count(to) / sizeof(struct lunix_record);
+	if (!max)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	done = 0;
+	while (done < max) {
+		for (n = 0; n < LUNIX_CHRDEV_RECS && done + n < max; n++) {
+			if (!lunix_chrdev_state_fetch(state, &sample))
+				break;
+			recs[n].serial = sample.serial;
+			recs[n].__pad = 0;
+			recs[n].timestamp = sample.timestamp;
+			recs[n].raw = sample.value;
+			recs[n].__pad2 = 0;
+			recs[n].cooked = sample.cooked;
+		}
+
+		if (n == 0) {
+			/* Return what we have, or sleep for the first sample */
+			if (done)
+				break;
+
+			/* Or report EOF, if no more samples are coming */
+			if (READ_ONCE(state->sensor->disconnected))
+				break;
+
+			mutex_unlock(&state->lock);
+			if (filp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			if (lunix_chrdev_wait(state))
+				return -ERESTARTSYS;
+			if (mutex_lock_interruptible(&state->lock))
+				return -ERESTARTSYS;
+			continue;
+		}
+
+		if (copy_to_iter(recs, n * sizeof(struct lunix_record), to) !=
+		    n * sizeof(struct lunix_record)) {
+			ret = done ? done * sizeof(struct lunix_record) : -EFAULT;
+			goto unlock;
+		}
+		done += n;
+	}
+
+	ret = done * sizeof(struct lunix_record);
+unlock:
+	mutex_unlock(&state->lock);
+	return ret;
+}
+
+/*
+ * Fill the user buffer with as many formatted values as are available,
+ * sleeping only if there is none to report yet. A value that does not
+ * fit is continued on the next read(); the file position is the offset
+ * into the cached value and rewinds to 0 once all of it has been read.
+ */
+static ssize_t lunix_chrdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+	size_t  done;
 	size_t  rfsize;
 
+	struct file *filp = iocb->ki_filp;
 	struct lunix_sensor_struct *sensor;
 	struct lunix_chrdev_state_struct *state;
 
@@ -324,115 +854,158 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 
 	debug("entering read()\n");
 
-	/* Lock? */
-	/* !(mutex_is_locked(&state->lock)) && */
-    /* mutex_lock_interruptible(&sensor->lock) */
-
-    /* state->lock : semaphore - actions: up() / down() */
-	if (down_interruptible(&state->lock)) { /* if not locked, try acquire the lock */
-		
-		/* mutex_lock_interruptible(struct mutex *lock):
-		   Lock the mutex like mutex_lock, and return 0 if the mutex has been acquired 
-		   or sleep until the mutex becomes available.
-		   If a signal arrives while waiting for the lock then this function returns -EINTR. 
-		*/		
-
-        debug("Couldn't acquire lock [read]\n");
-		ret = -EINTR; /* if lock() interrupted */
-		goto out;   /* unable to lock the mutex */
-	}
+	if (READ_ONCE(state->mode) == BINARY)
+		return lunix_chrdev_read_records(filp, to);
+
+	done = 0;
 
-    // TODO
 	/*
-	 * If the cached character device state needs to be
-	 * updated by actual sensor data (i.e. we need to report
-	 * on a "fresh" measurement, do so
+	 * mutex_lock_interruptible(struct mutex *lock):
+	 * Returns 0 if the mutex has been acquired, or -EINTR
+	 * if a signal arrived while waiting for it.
 	 */
-	if (*f_pos == 0) {  /* we are at the beginning position */
-		while (lunix_chrdev_state_update(state) == -EAGAIN) {
-
-			/* mutex_unlock(&state->lock); */
-			up(&state->lock);
-
-			/* The process needs to sleep =>> semaphore lock */
-			/* See LDD3, page 153 for a hint */
+	if (mutex_lock_interruptible(&state->lock)) {
+		debug("Couldn't acquire lock [read]\n");
+		ret = -ERESTARTSYS;
+		goto out;
+	}
 
-			if (filp->f_flags & O_NONBLOCK) { /* NON BLOCKING */
-				ret = -ERESTARTSYS;
-				goto out;
-			}
+	while (iov_iter_count(to) > 0) {
+		/* Past the end of the cached value? Auto-rewind */
+		if (iocb->ki_pos >= state->buf_lim)
+			iocb->ki_pos = 0;
 
-			/*  The process is put to sleep (TASK_INTERRUPTIBLE) until the condition evaluates to true or a signal is received. The condition is checked each time the waitqueue wq is woken up.
-			    The function will return -ERESTARTSYS if it was interrupted by a signal and 0 if condition evaluated to true.
-			 */
-			if( wait_event_interruptible(sensor->wq, lunix_chrdev_state_needs_refresh(state)) ) {
-				ret = -ERESTARTSYS;
-				goto out;
+		/*
+		 * If the cached character device state needs to be
+		 * updated by actual sensor data (i.e. we need to report
+		 * on a "fresh" measurement, do so
+		 */
+		if (iocb->ki_pos == 0) {  /* we are at the beginning position */
+			ret = lunix_chrdev_state_update(state);
+			if (ret == -EAGAIN) {
+				/* Return what we have, or sleep for the first value */
+				if (done)
+					break;
+
+				/* Or report EOF, if no more values are coming */
+				if (READ_ONCE(sensor->disconnected))
+					break;
+
+				mutex_unlock(&state->lock);
+
+				/* See LDD3, page 153 for a hint */
+				if (filp->f_flags & O_NONBLOCK) { /* NON BLOCKING */
+					ret = -EAGAIN;
+					goto out;
+				}
+
+				/*  The process is put to sleep (TASK_INTERRUPTIBLE) until there is a fresh
+				    measurement passing its filter, or a signal is received.
+				    Returns -ERESTARTSYS if it was interrupted by a signal.
+				 */
+				if (lunix_chrdev_wait(state)) {
+					ret = -ERESTARTSYS;
+					goto out;
+				}
+
+				if (mutex_lock_interruptible(&state->lock)) {
+					ret = -ERESTARTSYS;
+					goto out;
+				}
+				continue;
 			}
+			if (ret < 0)
+				goto unlock;
+		}
 
-			/* make sure mutex is unlocked before trying to acquire
-			if (!mutex_is_locked(&sensor->lock) && mutex_lock_interruptible(&sensor->lock)) {
+		/* Determine the number of cached bytes to copy to userspace */
+		rfsize = min_t(size_t, iov_iter_count(to), state->buf_lim - iocb->ki_pos);
 
-			}
-			*/
-			if (down_interruptible(&state->lock)) {
-				ret = -ERESTARTSYS;
-				goto out;
-			}
+		/* copy_to_iter: Returns number of bytes copied */
+		if (copy_to_iter(state->buf_data + iocb->ki_pos, rfsize, to) != rfsize) { // partial copy
+			ret = -EFAULT;
+			goto unlock;
 		}
-	}
 
-	/* total_size - current_position = remaining_data */
-	remaining_data = state->buf_lim - *f_pos;
+		iocb->ki_pos += rfsize;
+		done += rfsize;
 
-	/* End of file */
-	if (remaining_data <= 0) { // EOF
-		printk(KERN_DEBUG "Reached EOF\n");
-		return -ENOSPC; /* No space left on device */
+		/* All of the value has been read: poll() waits for the next one */
+		if (iocb->ki_pos == state->buf_lim)
+			iocb->ki_pos = 0;
 	}
 
-	/* Determine the number of cached bytes to copy to userspace */
-	rfsize = (*f_pos + cnt >= state->buf_lim) ? state->buf_lim - *f_pos : cnt;
+	/* return number of bytes succesfully read */
+	ret = done;
 
-	/* copy_to_user: Returns number of bytes that could not be copied.
-	 * On success, this will be zero.
-	 */
-	if ((remaining_data = copy_to_user(usrbuf, state->buf_data + *f_pos, rfsize)) != 0) { // partial copy
-		ret = -EFAULT;
-		goto unlock;
-	}
+unlock:
+	mutex_unlock(&state->lock);
+out:
+	if (ret < 0 && done > 0)
+		ret = done;
+	return ret;
+}
 
-	/*
-	 * On success, remaining_data = 0
-	 * and therefore |rfsize| bytes of data have been copied
-	 */
-	*f_pos += rfsize;
+/*
+ * Report the device node as readable once a fresh measurement has arrived,
+ * or while part of the cached one has not been read yet.
+ */
+static unsigned int lunix_chrdev_poll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask;
+	struct lunix_chrdev_state_struct *state;
 
-	/* return number of bytes succesfully read */
-	ret = rfsize;
+	state = (struct lunix_chrdev_state_struct *)filp->private_data;
+	WARN_ON(!state);
 
-	/* Auto-rewind on EOF mode? */
-	if (*f_pos >= state->buf_lim) {
-		debug("EOF: auto-rewind\n");
-		*f_pos = 0;
-	}
+	poll_wait(filp, &state->sensor->wq, wait);
 
-unlock: /* Unlock? */
-    /* make sure mutex is locked before trying to unlock */
-    /* mutex_is_locked(&sensor->lock) */
-    /* mutex_unlock(&sensor->lock); */
-    // sem_getvalue(&state->lock, &sem_val);
-	// if (sem_val == 0) { // indicates that lock is acquired =>> we need to release the lock
-    up(&state->lock);
-	// }
-out:
-	return ret;
+	mask = 0;
+	if (filp->f_pos != 0 || lunix_chrdev_state_needs_refresh(state))
+		mask |= POLLIN | POLLRDNORM;
+	if (READ_ONCE(state->sensor->disconnected))
+		mask |= POLLHUP;
+
+	return mask;
 }
 
-// TODO
+/*
+ * Map the measurement page of this device node to userspace, read-only.
+ * Readers check its magic and version, then use the seq field of
+ * struct lunix_msr_data_struct to get a consistent view of the values
+ * without any further syscalls.
+ */
 static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	return -EINVAL;
+	int ret;
+	unsigned long pfn;
+	struct lunix_chrdev_state_struct *state;
+
+	state = (struct lunix_chrdev_state_struct *)filp->private_data;
+	WARN_ON(!state);
+
+	debug("entering mmap()\n");
+
+	/* There is exactly one page to map, starting at offset 0 */
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* The page belongs to the line discipline, userspace only gets to look */
+	if (vma->vm_flags & VM_WRITE) {
+		ret = -EACCES;
+		goto out;
+	}
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+	pfn = virt_to_phys(state->sensor->msr_data[state->type]) >> PAGE_SHIFT;
+	ret = remap_pfn_range(vma, vma->vm_start, pfn, PAGE_SIZE, vma->vm_page_prot);
+
+out:
+	debug("leaving mmap(), with ret = %d\n", ret);
+	return ret;
 }
 
 /* TODO
@@ -476,14 +1049,103 @@ static int lunix_chrdev_llseek(struct file *filp, loff_t offset, int orig)
 	return ret;
 }
 
+/*
+ * Is there a health or routing packet newer than the one last read?
+ */
+static int lunix_chrdev_msg_pending(struct lunix_chrdev_state_struct *state)
+{
+	return READ_ONCE(state->sensor->msg_data[state->msg]->serial) != state->buf_serial;
+}
+
+/*
+ * Health and routing nodes: every read() returns the payload of the latest
+ * packet of the kind, truncated to the size of the buffer, sleeping until
+ * one newer than the last one read has arrived.
+ */
+static ssize_t lunix_chrdev_msg_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+	size_t len;
+	uint32_t serial;
+	unsigned char payload[LUNIX_MSG_MAXLEN];
+
+	struct file *filp = iocb->ki_filp;
+	struct lunix_sensor_struct *sensor;
+	struct lunix_chrdev_state_struct *state;
+
+	state = (struct lunix_chrdev_state_struct *)filp->private_data;
+	WARN_ON(!state);
+	sensor = state->sensor;
+
+	if (mutex_lock_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	while (!lunix_chrdev_msg_pending(state)) {
+		mutex_unlock(&state->lock);
+
+		/* EOF, if no more packets are coming */
+		if (READ_ONCE(sensor->disconnected))
+			return 0;
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(sensor->msg_wq[state->msg],
+					     lunix_chrdev_msg_pending(state) ||
+					     READ_ONCE(sensor->disconnected)))
+			return -ERESTARTSYS;
+
+		if (mutex_lock_interruptible(&state->lock))
+			return -ERESTARTSYS;
+	}
+
+	len = lunix_sensor_read_msg(sensor, state->msg, payload, &serial);
+	state->buf_serial = serial;
+
+	len = min_t(size_t, len, iov_iter_count(to));
+	ret = len;
+	if (copy_to_iter(payload, len, to) != len)
+		ret = -EFAULT;
+
+	mutex_unlock(&state->lock);
+	return ret;
+}
+
+static unsigned int lunix_chrdev_msg_poll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask;
+	struct lunix_chrdev_state_struct *state;
+
+	state = (struct lunix_chrdev_state_struct *)filp->private_data;
+	WARN_ON(!state);
+
+	poll_wait(filp, &state->sensor->msg_wq[state->msg], wait);
+
+	mask = 0;
+	if (lunix_chrdev_msg_pending(state))
+		mask |= POLLIN | POLLRDNORM;
+	if (READ_ONCE(state->sensor->disconnected))
+		mask |= POLLHUP;
+
+	return mask;
+}
+
+static struct file_operations lunix_chrdev_msg_fops =
+{   .owner          = THIS_MODULE,
+	.release        = lunix_chrdev_release,	/* destroy device */
+	.read_iter      = lunix_chrdev_msg_read_iter,	/* get the latest packet */
+	.poll           = lunix_chrdev_msg_poll,	/* wait for a packet */
+	.llseek         = no_llseek,
+};
+
 // TODO
 static struct file_operations lunix_chrdev_fops = 
 {   .owner          = THIS_MODULE,
 	.open           = lunix_chrdev_open, 	/* register device */
 	.release        = lunix_chrdev_release,	/* destroy device */
-	.read           = lunix_chrdev_read,	/* get data */
-	.unlocked_ioctl = lunix_chrdev_ioctl,	/* TODO */
-	.mmap           = lunix_chrdev_mmap,	/* TODO */
+	.read_iter      = lunix_chrdev_read_iter,	/* get data */
+	.poll           = lunix_chrdev_poll,	/* wait for data */
+	.unlocked_ioctl = lunix_chrdev_ioctl,	/* snapshot, settings */
+	.compat_ioctl   = lunix_chrdev_ioctl,	/* same layouts for 32-bit callers */
+	.mmap           = lunix_chrdev_mmap,	/* map measurement page */
 	.llseek         = lunix_chrdev_llseek,	/* change position */
 };
 
@@ -491,12 +1153,12 @@ int lunix_chrdev_init(void)
 {
 	/*
 	 * Register the character device with the kernel, asking for
-	 * a range of minor numbers (number of sensors * 8 measurements / sensor)
+	 * a range of minor numbers (number of node ids * 8 measurements / sensor)
 	 * beginning with LINUX_CHRDEV_MAJOR:0
 	 */
 	int ret;
 	dev_t dev_no; /* device number */
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	unsigned int lunix_minor_cnt = LUNIX_MAX_NODES << 3;
 
 	debug("init: initializing character device\n");
 
@@ -557,7 +1219,7 @@ out:
 void lunix_chrdev_destroy(void)
 {
 	dev_t dev_no;
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	unsigned int lunix_minor_cnt = LUNIX_MAX_NODES << 3;
 
 	debug("entering\n");
 	dev_no = MKDEV(LUNIX_CHRDEV_MAJOR, 0);
@@ -14,7 +14,10 @@
  * Lunix:TNG character device
  */
 #define LUNIX_CHRDEV_MAJOR	60	    /* Reserved for local / experimental use */
-#define LUNIX_CHRDEV_BUFSZ  20      /* Buffer size used to hold textual info */
+#define LUNIX_CHRDEV_BUFSZ  64      /* Buffer size used to hold textual info */
+#define LUNIX_CHRDEV_RECS   16      /* Binary records copied to userspace at once */
+#define LUNIX_SNAPSHOT_CHUNK 16     /* Snapshot entries copied to userspace at once */
+#define LUNIX_PRECISION_MAX  3       /* Decimals of text values [thousandths] */
 
 /* Compile-time parameters */
 
@@ -22,29 +25,152 @@
 
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/mutex.h>
 #include <linux/module.h>
 
 #include "lunix.h"
 
+#else
+#include <inttypes.h>
+#endif	/* __KERNEL__ */
+
+#include <linux/ioctl.h>
+
+/*
+ * Measurements of a single sensor, as returned by LUNIX_IOC_SNAPSHOT,
+ * raw and converted to thousandths of the unit.
+ * Entries describe the sensors known to the driver in order of node id,
+ * starting from node first. Sensors are known once a packet has been
+ * received from the node, or one of its device nodes has been opened
+ * by the administrator.
+ */
+struct lunix_snapshot_entry {
+	uint32_t batt;
+	uint32_t temp;
+	uint32_t light;
+	uint32_t last_update;
+	uint32_t serial;	/* serial of the latest sample */
+	uint32_t nodeid;
+	uint64_t timestamp;	/* monotonic time of the latest sample, in ns */
+	int32_t batt_cooked;
+	int32_t temp_cooked;
+	int32_t light_cooked;
+	uint32_t __pad;
+};
+
+struct lunix_snapshot {
+	uint32_t cnt;		/* in: size of the array, out: entries filled */
+	uint32_t first;		/* lowest node id to report */
+	uint64_t entries;	/* userspace pointer to the array */
+};
+
+/*
+ * A single sample, as returned by read() in BINARY mode.
+ * A read() returns as many whole records as fit in the buffer.
+ */
+struct lunix_record {
+	uint32_t serial;
+	uint32_t __pad;
+	uint64_t timestamp;	/* monotonic time, in ns */
+	uint16_t raw;		/* raw 16-bit measurement */
+	uint16_t __pad2;
+	int32_t cooked;		/* converted value, in thousandths of the unit */
+};
+
+/*
+ * Wakeup filter of an open file, set with LUNIX_IOC_SET_FILTER.
+ * It applies when reporting the latest value [not in history mode].
+ * Values are converted ones, in thousandths of the unit. A new value
+ * is only reported, and sleeping readers are only woken up for it,
+ * if it differs by at least deadband from the last value reported,
+ * if it lies on the other side of threshold, or, with LUNIX_FILTER_CHANGED,
+ * if it differs at all from the last value reported. With no flags set,
+ * every new value is reported, repeated ones included.
+ */
+#define LUNIX_FILTER_DEADBAND		0x1
+#define LUNIX_FILTER_THRESHOLD		0x2
+#define LUNIX_FILTER_CHANGED		0x4
+
+struct lunix_filter {
+	uint32_t flags;
+	int32_t deadband;
+	int32_t threshold;
+	uint32_t __pad;
+};
+
+/*
+ * Calibration of a measurement of a sensor, set with LUNIX_IOC_SET_CALIB
+ * on one of its device nodes, in place of the built-in conversion.
+ * A raw value r converts to entry r >> shift of the table, interpolated
+ * linearly towards the next entry; past the last entry, to the last one.
+ * Entries are in thousandths of the unit, within +-LUNIX_CALIB_RANGE, so
+ * that the difference of any two converted values fits in 32 bits.
+ * cnt == 0 restores the built-in conversion. Takes effect for values
+ * received from then on.
+ */
+#define LUNIX_CALIB_MAX			1025
+#define LUNIX_CALIB_RANGE		1000000000
+
+struct lunix_calib {
+	uint32_t cnt;		/* entries in the table, up to LUNIX_CALIB_MAX */
+	uint32_t shift;		/* up to 16 */
+	uint64_t table;		/* userspace pointer to an int32_t array */
+};
+
+/*
+ * Definition of ioctl commands
+ */
+#define LUNIX_IOC_MAGIC			LUNIX_CHRDEV_MAJOR
+#define LUNIX_IOC_SNAPSHOT		_IOWR(LUNIX_IOC_MAGIC, 0, struct lunix_snapshot)
+#define LUNIX_IOC_HISTORY		_IOW(LUNIX_IOC_MAGIC, 1, int)
+#define LUNIX_IOC_SET_MODE		_IOW(LUNIX_IOC_MAGIC, 2, int)	/* enum lunix_data_parse_mode */
+#define LUNIX_IOC_GET_STATS		_IOR(LUNIX_IOC_MAGIC, 3, struct lunix_msr_stats)
+#define LUNIX_IOC_TAKE_STATS		_IOR(LUNIX_IOC_MAGIC, 4, struct lunix_msr_stats)	/* and reset */
+#define LUNIX_IOC_SET_FILTER		_IOW(LUNIX_IOC_MAGIC, 5, struct lunix_filter)
+#define LUNIX_IOC_SET_CALIB		_IOW(LUNIX_IOC_MAGIC, 6, struct lunix_calib)	/* CAP_SYS_ADMIN */
+#define LUNIX_IOC_SET_PRECISION		_IOW(LUNIX_IOC_MAGIC, 7, int)	/* decimals, up to LUNIX_PRECISION_MAX */
+
+#define LUNIX_IOC_MAXNR			7	
+
+#ifdef __KERNEL__
+
 /*
  * Private state for an open character device node
  */
 struct lunix_chrdev_state_struct {
 	enum lunix_msr_enum type;
+	enum lunix_msg_enum msg;	/* instead of type, on health and routing nodes */
 
 	struct lunix_sensor_struct *sensor;
 
 	/* A buffer used to hold cached textual info */
 	int buf_lim;
 	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
-	uint32_t buf_timestamp;
+	uint32_t buf_serial;
+	uint64_t buf_timestamp;
+
+	struct mutex lock;
+
+	/*
+	 * History mode: instead of the latest value, report every
+	 * sample in the measurement ring, starting from ring_pos.
+	 */
+	int history;
+	uint32_t ring_pos;
 
-	struct semaphore lock;
+	/*
+	 * Wakeup filter, and the last value [converted]
+	 * that was reported through it
+	 */
+	struct lunix_filter filter;
+	int filter_primed;
+	long filter_last;
 
 	/*
 	 * Fixme: Any mode settings? e.g. blocking vs. non-blocking
 	 */
 	enum lunix_data_parse_mode mode;
+	int precision;		/* decimals of text values */
 };
 
 /*
@@ -55,15 +181,5 @@ void lunix_chrdev_destroy(void);
 
 #endif	/* __KERNEL__ */
 
-#include <linux/ioctl.h>
-
-/*
- * Definition of ioctl commands
- */
-#define LUNIX_IOC_MAGIC			LUNIX_CHRDEV_MAJOR
-//#define LUNIX_IOC_EXAMPLE		_IOR(LUNIX_IOC_MAGIC, 0, void *)
-
-#define LUNIX_IOC_MAXNR			0	
-
 #endif	/* _LUNIX_H */
 
@@ -0,0 +1,177 @@
+/*
+ * lunix-format-bench.c
+ *
+ * Checks the formatter of text values of the Lunix:TNG character
+ * device [lunix-format.h] against snprintf(), and times it against
+ * the snprintf() path it replaced.
+ *
+ * Correctness: for every precision from 0 to LUNIX_PRECISION_MAX, every
+ * value in [-LIMIT, LIMIT], the INT32 extremes and a run of random
+ * values are formatted both ways and compared. The reference rounds
+ * half away from zero in 64-bit arithmetic, then prints with snprintf().
+ *
+ * Timing: the same values are formatted by the old path [two snprintf()
+ * calls and a strnlen() per value, three decimals] and by the new one.
+ * Timings are of glibc's snprintf(), not the kernel's, so only indicative.
+ *
+ *	./lunix-format-bench [-n values]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "lunix-format.h"
+
+#define LIMIT		2000000		/* thousandths: all values up to +-2000.000 */
+#define RANDOM_CNT	10000000
+
+static unsigned int timing_cnt = 10000000;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * What lunix_chrdev_format_cooked() must produce, through snprintf()
+ */
+static int reference(char *buf, size_t size, int32_t value, int prec)
+{
+	uint64_t mag, div, scale, q;
+
+	div = lunix_chrdev_pow10[LUNIX_PRECISION_MAX - prec];
+	scale = lunix_chrdev_pow10[prec];
+
+	mag = (value < 0) ? -(int64_t)value : value;
+	q = (2 * mag + div) / (2 * div);
+
+	if (prec == 0)
+		return snprintf(buf, size, "%c%" PRIu64 "\n",
+			(value < 0 && q) ? '-' : '+', q);
+	return snprintf(buf, size, "%c%" PRIu64 ".%0*" PRIu64 "\n",
+		(value < 0 && q) ? '-' : '+', q / scale, prec, q % scale);
+}
+
+static unsigned long checked, failed;
+
+static void check(int32_t value, int prec)
+{
+	int len, ref_len;
+	unsigned char buf[LUNIX_CHRDEV_BUFSZ];
+	char ref[LUNIX_CHRDEV_BUFSZ];
+
+	len = lunix_chrdev_format_cooked(buf, value, prec);
+	ref_len = reference(ref, sizeof(ref), value, prec);
+
+	checked++;
+	if (len != ref_len || memcmp(buf, ref, len)) {
+		if (failed++ < 10)
+			fprintf(stderr, "value %" PRId32 ", precision %d: got \"%.*s\", expected \"%.*s\"\n",
+				value, prec, len - 1, buf, ref_len - 1, ref);
+	}
+}
+
+/*
+ * The path replaced by lunix_chrdev_format_cooked(), as it was
+ * in lunix_chrdev_state_update(), for COOKED mode
+ */
+static int old_format_cooked(unsigned char *buf_data, long __data)
+{
+	long dec, frac;
+	unsigned char sign;
+
+	sign = (__data >= 0) ? '+' : '-';
+	dec = __data / 1000;
+	frac = __data % 1000;
+
+	snprintf((char *)buf_data, LUNIX_CHRDEV_BUFSZ, "%c%ld.%ld\n", sign, dec, frac);
+	return strnlen((char *)buf_data, LUNIX_CHRDEV_BUFSZ) + 1;
+}
+
+static int new_format_cooked(unsigned char *buf_data, long __data)
+{
+	return lunix_chrdev_format_cooked(buf_data, __data, LUNIX_PRECISION_MAX);
+}
+
+static void run(const char *name, const int32_t *values, unsigned int cnt,
+	int (*format)(unsigned char *, long))
+{
+	unsigned int i;
+	uint64_t start, ns, sum;
+	unsigned char buf[LUNIX_CHRDEV_BUFSZ];
+
+	sum = 0;
+	start = now_ns();
+	for (i = 0; i < cnt; i++)
+		sum += format(buf, values[i]) + buf[1];
+	ns = now_ns() - start;
+
+	/* sum only keeps the compiler from dropping the calls */
+	printf("%-9s %7.2f ns/value  [%" PRIu64 "]\n", name, (double)ns / cnt, sum);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, prec;
+	int32_t v, *values;
+	unsigned int i;
+	static const int32_t extremes[] = {
+		INT32_MIN, INT32_MIN + 1, INT32_MIN + 499, INT32_MIN + 500,
+		INT32_MAX, INT32_MAX - 1, INT32_MAX - 499, INT32_MAX - 500,
+		-1, 0, 1, -5, 5, -49, 49, -50, 50, -499, 499, -500, 500, -501, 501,
+	};
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			timing_cnt = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n values]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (timing_cnt < 1)
+		timing_cnt = 1;
+
+	/*
+	 * Correctness
+	 */
+	srandom(1);
+	for (prec = 0; prec <= LUNIX_PRECISION_MAX; prec++) {
+		for (v = -LIMIT; v <= LIMIT; v++)
+			check(v, prec);
+		for (i = 0; i < sizeof(extremes) / sizeof(extremes[0]); i++)
+			check(extremes[i], prec);
+		for (i = 0; i < RANDOM_CNT; i++)
+			check((int32_t)((uint32_t)random() << 1 ^ (uint32_t)random()), prec);
+	}
+	printf("%lu values checked against snprintf(), %lu mismatches\n", checked, failed);
+
+	/*
+	 * Timing, on values as the sensors report them:
+	 * a few degrees, volts or thousands of lux
+	 */
+	values = malloc(timing_cnt * sizeof(*values));
+	if (!values) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < timing_cnt; i++)
+		values[i] = (int32_t)(random() % (2 * LIMIT + 1)) - LIMIT;
+
+	run("snprintf", values, timing_cnt, old_format_cooked);
+	run("utoa", values, timing_cnt, new_format_cooked);
+
+	return failed ? 1 : 0;
+}
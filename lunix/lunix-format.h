@@ -0,0 +1,82 @@
+/*
+ * lunix-format.h
+ *
+ * Formatting of values as text, without going through snprintf(),
+ * for the Lunix:TNG character device. Also built in userspace,
+ * by lunix-format-bench.
+ *
+ */
+
+#ifndef _LUNIX_FORMAT_H
+#define _LUNIX_FORMAT_H
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <asm/div64.h>
+
+#else
+#include <inttypes.h>
+
+/* As in <asm/div64.h>: divide n in place, return the remainder */
+#define do_div(n, base) ({				\
+	uint32_t __rem = (n) % (base);			\
+	(n) /= (base);					\
+	__rem;						\
+})
+#endif	/* __KERNEL__ */
+
+#include "lunix-chrdev.h"
+
+/*
+ * Integer to ASCII, without going through snprintf(): write the decimal
+ * digits of v to buf, zero padded to at least min_digits. Returns the
+ * number of characters written, at most 20.
+ */
+static inline int lunix_chrdev_utoa(unsigned char *buf, uint64_t v, int min_digits)
+{
+	int i, n;
+	unsigned char digits[20];
+
+	n = 0;
+	do {
+		digits[n++] = '0' + do_div(v, 10);
+	} while (v || n < min_digits);
+
+	for (i = 0; i < n; i++)
+		buf[i] = digits[n - 1 - i];
+	return n;
+}
+
+static const uint32_t lunix_chrdev_pow10[] = { 1, 10, 100, 1000 };
+
+/*
+ * Format a value in thousandths of the unit as a signed fixed-point
+ * number with prec decimals [up to 3], rounded half away from zero,
+ * followed by a newline. Returns the number of characters written,
+ * at most 16.
+ */
+static inline int lunix_chrdev_format_cooked(unsigned char *buf, int32_t value, int prec)
+{
+	int len;
+	uint32_t v, div, scale;
+
+	div = lunix_chrdev_pow10[LUNIX_PRECISION_MAX - prec];
+	scale = lunix_chrdev_pow10[prec];
+
+	v = (value < 0) ? -(uint32_t)value : value;
+	v = v / div + (v % div >= (div + 1) / 2 && div > 1);
+
+	len = 0;
+	buf[len++] = (value < 0 && v) ? '-' : '+';
+	len += lunix_chrdev_utoa(buf + len, v / scale, 1);
+	if (prec) {
+		buf[len++] = '.';
+		len += lunix_chrdev_utoa(buf + len, v % scale, prec);
+	}
+	buf[len++] = '\n';
+
+	return len;
+}
+
+#endif	/* _LUNIX_FORMAT_H */
@@ -0,0 +1,306 @@
+/*
+ * lunix-framing.h
+ *
+ * Framing of XMesh packets out of the byte stream of a gateway,
+ * for the Lunix:TNG protocol state machine [lunix-protocol.c].
+ * Also built in userspace, by lunix-parse-bench.
+ *
+ * Ioannis Panagopoulos <ioannis@cslab.ece.ntua.gr>
+ * Vangelis Koukis <vkoukis@cslab.ece.ntua.gr>
+ *
+ */
+
+#ifndef _LUNIX_FRAMING_H
+#define _LUNIX_FRAMING_H
+
+#ifdef __KERNEL__
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+
+#else
+#include <string.h>
+
+/* As in <linux/kernel.h> and <asm/unaligned.h> */
+#define REPEAT_BYTE(x)	((~0ul / 0xff) * (x))
+#define __lunix_unaligned(p)	struct { __typeof__(*(p)) v; } __attribute__((packed))
+#define get_unaligned(p)	(((const __lunix_unaligned(p) *)(p))->v)
+#define put_unaligned(val, p)	((void)(((__lunix_unaligned(p) *)(p))->v = (val)))
+#endif	/* __KERNEL__ */
+
+/*
+ * Application/Protocol specific constants
+ */
+#define MAX_PACKET_LEN 300
+#define PACKET_SIGNATURE_OFFSET 4
+#define PAYLOAD_LENGTH_OFFSET 6
+#define PAYLOAD_OFFSET 7
+#define NODE_OFFSET 9
+#define VREF_OFFSET 18
+#define TEMPERATURE_OFFSET 20
+#define LIGHT_OFFSET 22
+
+/*
+ * States of the Lunix protocol state machine. Escaped fields that
+ * follow one another are read as a single span: the destination
+ * address, AM type, AM group and payload length as the header,
+ * the payload along with the CRC after it.
+ */
+#define SEEKING_START_BYTE             1
+#define SEEKING_PACKET_TYPE            2
+#define SEEKING_HEADER                 3
+#define SEEKING_PAYLOAD                4
+#define SEEKING_END_BYTE               5
+
+/*
+ * Current state of the Lunix protocol state machine
+ */
+struct lunix_protocol_state_struct
+{
+	int state;                      /* The current state of the protocol state machine */
+	int bytes_read;
+	int bytes_to_read;
+
+	unsigned long gateway;          /* Id of the TTY the data come from [see lunix-ldisc.c] */
+
+	int pos;                        /* Current pos in the XMesh Packet */
+	unsigned char next_is_special;  /* The next character to be received is a special character */
+	unsigned char payload_length;   /* The length of the payload of the received packet */
+	unsigned char packet[MAX_PACKET_LEN]; /* The XMesh packet being received */
+};
+
+/*
+ * Outcomes of lunix_protocol_frame()
+ */
+#define LUNIX_FRAME_NONE               0  /* All of the data have been consumed */
+#define LUNIX_FRAME_PACKET             1  /* state->packet holds a packet, state->pos bytes long */
+#define LUNIX_FRAME_OVERFLOW           2  /* Dropped a packet longer than MAX_PACKET_LEN */
+#define LUNIX_FRAME_ERROR              3  /* Dropped a packet cut short, or missing its end byte */
+
+/**********************************************************************************
+ * PACKET STRUCTURE
+ * BYTE				VALUE		MEANING
+ * 0				0x7E		Packet Start byte signature
+ * 1				0x??		Packet Type
+ * 2-3				0x??		Destination Address
+ * 4				0x??		AM Type
+ * 5				0x??		AM Group
+ * 6				0x??		Payload length (PL)
+ * 7-(7 + PL-1)			0x??		PayLoad
+ * (7 + PL)-(7 + PL + 1)	0x??		CRC
+ * (7 + PL + 2)			0X7E		Packet End byte signature
+ **********************************************************************************/
+
+/*
+ * The states of the protocol state machine are visited in order, from
+ * SEEKING_START_BYTE to SEEKING_END_BYTE. For each one, the table holds
+ * the number of bytes to read [0 for the payload, whose length is taken
+ * from the header] and whether escaped characters may appear in it.
+ */
+static const struct lunix_protocol_step {
+	int bytes_to_read;
+	int use_specials;
+} lunix_protocol_steps[] = {
+	[SEEKING_START_BYTE]          = { 1, 0 },
+	[SEEKING_PACKET_TYPE]         = { 1, 0 },
+	[SEEKING_HEADER]              = { 5, 1 },
+	[SEEKING_PAYLOAD]             = { 0, 1 },
+	[SEEKING_END_BYTE]            = { 1, 0 },
+};
+
+/*
+ * Helper function to quickly set the current state
+ */
+static inline void set_state(struct lunix_protocol_state_struct *statep, int state, int btr, int br)
+{
+	statep->state = state;
+	statep->bytes_to_read = btr;
+	statep->bytes_read = br;
+}
+
+/*
+ * Move on to the state following the current one
+ */
+static inline void next_state(struct lunix_protocol_state_struct *statep)
+{
+	int state = statep->state + 1;
+	int btr = lunix_protocol_steps[state].bytes_to_read;
+
+	/* The payload, then its 2-byte CRC */
+	if (state == SEEKING_PAYLOAD)
+		btr = statep->packet[statep->pos - 1] + 2;
+	set_state(statep, state, btr, 0);
+}
+
+/*
+ * Initialization of protocol state machine
+ */
+static inline void lunix_protocol_init(struct lunix_protocol_state_struct *state)
+{
+	state->pos = 0;
+	state->next_is_special = 0;
+	set_state(state, SEEKING_START_BYTE, 1, 0);
+}
+
+/*
+ * Copies the run of ordinary bytes [neither 0x7E nor 0x7D] at the start
+ * of src to dst, looking at no more than len bytes. Returns its length.
+ * The bulk of the data is scanned and copied a word at a time: a word
+ * contains one of the two special bytes iff it has a zero byte once
+ * XORed with it repeated.
+ */
+#define ONES	REPEAT_BYTE(0x01)
+#define HIGHS	REPEAT_BYTE(0x80)
+#define has_zero_byte(v)	(((v) - ONES) & ~(v) & HIGHS)
+
+static inline int lunix_protocol_plain_copy(unsigned char *dst, const unsigned char *src, int len)
+{
+	int n;
+	unsigned long w;
+
+	for (n = 0; n + (int)sizeof(w) <= len; n += sizeof(w)) {
+		w = get_unaligned((const unsigned long *)(src + n));
+		if (has_zero_byte(w ^ REPEAT_BYTE(0x7E)) ||
+		    has_zero_byte(w ^ REPEAT_BYTE(0x7D)))
+			break;
+		put_unaligned(w, (unsigned long *)(dst + n));
+	}
+	for (; n < len; n++) {
+		if (0x7E == src[n] || 0x7D == src[n])
+			break;
+		dst[n] = src[n];
+	}
+
+	return n;
+}
+
+/*
+ * Crucial function for parsing the input packet according
+ * to the current state.
+ *
+ * struct lunix_protocol_state_struct *state:
+ * unsigned char *data: the data received
+ * int length: the amount of bytes received
+ * int *i: the pointer to the data received is updated when data are
+ *         transferred to the unparsed_packet array
+ * int use_specials: if 1 special characters are treated acc
+ *
+ * Runs of bytes needing no unescaping are copied in one go.
+ * Returns 1 when the state is complete, 0 when more data are needed,
+ * or a negative LUNIX_FRAME_* error if the packet must be dropped.
+ */
+static inline int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
+	const unsigned char *data, int length, int *i, int use_specials)
+{
+	int n;
+	unsigned char c;
+
+	while ((*i < length) && (state->bytes_read < state->bytes_to_read))
+	{
+		/* Prevent buffer overflows */
+		if (state->pos == MAX_PACKET_LEN)
+			return -LUNIX_FRAME_OVERFLOW;
+
+		c = data[*i];
+		if (use_specials) {
+			/*
+			 * A start byte can never appear unescaped inside a packet.
+			 * If it does, the packet has been cut short, and this is
+			 * where the next one begins.
+			 */
+			if (0x7E == c)
+				return -LUNIX_FRAME_ERROR;
+
+			if (state->next_is_special) {
+				c ^= 0x20;
+				state->next_is_special = 0;
+			} else if (0x7D == c) {
+				state->next_is_special = c;
+				++(*i);
+				continue;
+			} else {
+				n = length - *i;
+				if (n > state->bytes_to_read - state->bytes_read)
+					n = state->bytes_to_read - state->bytes_read;
+				if (n > MAX_PACKET_LEN - state->pos)
+					n = MAX_PACKET_LEN - state->pos;
+				n = lunix_protocol_plain_copy(&state->packet[state->pos], &data[*i], n);
+				state->pos += n;
+				state->bytes_read += n;
+				*i += n;
+				continue;
+			}
+		}
+
+		state->packet[state->pos] = c;
+		++state->pos;
+		++state->bytes_read;
+		++(*i);
+	}
+
+	if (state->bytes_read == state->bytes_to_read)
+		return 1;
+	return 0;
+}
+
+/*
+ * Runs the state machine over data[*i] to data[length - 1], up to the
+ * end of the next packet. Returns LUNIX_FRAME_PACKET once one has been
+ * received whole, or a LUNIX_FRAME_* error once one has been dropped;
+ * the caller resets the state with lunix_protocol_init() before going
+ * on. Returns LUNIX_FRAME_NONE once all of the data have been consumed.
+ * Bytes skipped while seeking a start byte are added to *skipped.
+ */
+static inline int lunix_protocol_frame(struct lunix_protocol_state_struct *state,
+	const unsigned char *data, int length, int *i, int *skipped)
+{
+	int ret;
+	const unsigned char *start;
+
+	while (*i < length) {
+		/* Skip anything up to the next start byte */
+		if (state->state == SEEKING_START_BYTE) {
+			start = memchr(&data[*i], 0x7E, length - *i);
+			if (!start) {
+				*skipped += length - *i;
+				*i = length;
+				break;
+			}
+			*skipped += start - &data[*i];
+			*i = start - data;
+		}
+
+		ret = lunix_protocol_parse_state(state, data, length, i,
+			lunix_protocol_steps[state->state].use_specials);
+		if (ret < 0)
+			return -ret;
+		if (ret == 0)
+			continue;
+
+		switch (state->state) {
+		case SEEKING_PACKET_TYPE:
+			/*
+			 * Two 0x7E in a row: the first one ended a packet
+			 * we never saw the start of, or was idle line.
+			 * The second one starts the packet.
+			 */
+			if (0x7E == state->packet[1]) {
+				state->pos = 1;
+				set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+				continue;
+			}
+			break;
+		case SEEKING_END_BYTE:
+			if (0x7E != state->packet[state->pos - 1])
+				return LUNIX_FRAME_ERROR;
+			return LUNIX_FRAME_PACKET;
+		}
+
+		next_state(state);
+	}
+
+	return LUNIX_FRAME_NONE;
+}
+
+#endif	/* _LUNIX_FRAMING_H */
@@ -13,6 +13,9 @@
 #include <linux/serio.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/kfifo.h>
+#include <linux/printk.h>
+#include <linux/workqueue.h>
 
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
@@ -22,28 +25,72 @@
 #include "lunix-protocol.h"
 
 /*
- * This line discipline can only be associated
- * with a single TTY at any time.
+ * Per-TTY state of the line discipline. Received bytes are queued in
+ * a FIFO and parsed later, by a work item, outside the flip buffer
+ * context. How much the FIFO can still take is all the TTY layer gets
+ * to push to us: the rest stays in its flip buffers, and the TTY is
+ * throttled once the FIFO fills up past LUNIX_LDISC_THROTTLE.
  */
-static atomic_t lunix_disc_available;
+struct lunix_ldisc_struct {
+	struct tty_struct *tty;
+	struct lunix_protocol_state_struct state;
+
+	struct kfifo fifo;
+	struct work_struct work;
+	unsigned long flags;
+};
+
+/* Bits in flags */
+#define LUNIX_LDISC_STALLED	0	/* the TTY layer has data we did not take */
+
+static void lunix_ldisc_work(struct work_struct *work);
+
+/*
+ * Every attachment of the line discipline to a TTY gets an id of its own,
+ * never reused, which the sensors heard from through it are linked to:
+ * unlike the address of its state, it cannot turn up again for another
+ * TTY once this one has been closed.
+ */
+static atomic_long_t lunix_ldisc_gateway_id = ATOMIC_LONG_INIT(0);
+static atomic_t lunix_ldisc_cnt = ATOMIC_INIT(0);
 
 /*
  * This function runs when the userspace helper
  * sets the Lunix:TNG line discipline on a TTY.
+ * Any number of TTYs [gateways] may use it at the same time,
+ * each one with its own state in tty->disc_data.
  */
 static int lunix_ldisc_open(struct tty_struct *tty)
 {
+	int ret;
+	struct lunix_ldisc_struct *ld;
+
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
-	
-	/* Can only be associated with a single TTY */
-	if ( !atomic_add_unless(&lunix_disc_available, -1, 0))
-		return -EBUSY;
 
-	tty->receive_room = 65536; /* No flow control, FIXME */
+	ret = -ENOMEM;
+	ld = kzalloc(sizeof(*ld), GFP_KERNEL);
+	if (!ld)
+		goto out;
+	if (kfifo_alloc(&ld->fifo, LUNIX_LDISC_FIFO_SIZE, GFP_KERNEL))
+		goto out_with_ld;
+
+	ld->tty = tty;
+	lunix_protocol_init(&ld->state);
+	ld->state.gateway = atomic_long_inc_return(&lunix_ldisc_gateway_id);
+	atomic_inc(&lunix_ldisc_cnt);
+	INIT_WORK(&ld->work, lunix_ldisc_work);
+	tty->disc_data = ld;
+
+	tty->receive_room = kfifo_avail(&ld->fifo);
 
 	debug("lunix ldisc associated with TTY %s\n", tty->name);
 	return 0;
+
+out_with_ld:
+	kfree(ld);
+out:
+	return ret;
 }
 
 /*
@@ -53,37 +100,87 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
-	atomic_inc(&lunix_disc_available);
-	/* FIXME */
-	/* Shouldn't we wake up all sleepers in all sensors here? */
+	struct lunix_ldisc_struct *ld = tty->disc_data;
+
+	/* No more data can arrive, drop whatever has not been parsed yet */
+	cancel_work_sync(&ld->work);
+
+	/* Let the readers of the sensors behind this gateway know */
+	lunix_sensor_disconnect(ld->state.gateway, atomic_dec_and_test(&lunix_ldisc_cnt));
+
+	kfifo_free(&ld->fifo);
+	kfree(ld);
+	tty->disc_data = NULL;
 	debug("lunix ldisc being closed\n");
 }
 
+/*
+ * Drain the FIFO of a TTY into the protocol state machine, which
+ * handles any necessary sensor updates. Then let the TTY layer
+ * push us more data, if it had to hold any back.
+ */
+static void lunix_ldisc_work(struct work_struct *work)
+{
+	unsigned int n;
+	unsigned char buf[256];
+	struct lunix_ldisc_struct *ld;
+	struct tty_struct *tty;
+
+	ld = container_of(work, struct lunix_ldisc_struct, work);
+	tty = ld->tty;
+
+	while ((n = kfifo_out(&ld->fifo, buf, sizeof(buf))) > 0)
+		lunix_protocol_received_buf(&ld->state, buf, n);
+	//debug("passed incoming bytes to state machine, leaving\n");
+
+	tty->receive_room = kfifo_avail(&ld->fifo);
+
+	if (test_bit(TTY_THROTTLED, &tty->flags) &&
+	    kfifo_avail(&ld->fifo) >= LUNIX_LDISC_UNTHROTTLE)
+		tty_unthrottle(tty);
+
+	if (test_and_clear_bit(LUNIX_LDISC_STALLED, &ld->flags))
+		tty_schedule_flip(tty->port);
+}
+
 /*
  * lunix_ldisc_receive() is called by the TTY layer when data have been
  * received by the low level TTY driver and are ready for us. This function
- * will not be re-entered while running.
+ * will not be re-entered while running. It queues as much of the data as
+ * there is room for, and returns how much that was.
  */
-static void lunix_ldisc_receive(struct tty_struct *tty,
+static int lunix_ldisc_receive(struct tty_struct *tty,
 	const unsigned char *cp, char *fp, int count)
 {
-#if 1
-#if LUNIX_DEBUG
 	int i;
-
-	debug("called, %d characters have been received. Data at *cp: { ", count);
-	for (i = 0; i < count; i++)
-		printk("0x%02x%s", cp[i], (i == count - 1) ? "" : ", ");
-	printk(" }\n");
-#endif
-	printk(KERN_INFO "lunix_ldisc_receive called\n");
-#endif
-	/*
-	 * Pass incoming characters to protocol processing code,
-	 * which handle any necessary sensor updates.
-	 */
-	lunix_protocol_received_buf(&lunix_protocol_state, cp, count);
-	//debug("passed incoming bytes to state machine, leaving\n");
+	unsigned int n;
+	struct lunix_ldisc_struct *ld = tty->disc_data;
+
+	/* Under dynamic debug only: never printed by default, even with DEBUG=y */
+	print_hex_dump_debug("lunix rx: ", DUMP_PREFIX_OFFSET, 16, 1, cp, count, false);
+
+	/* Count the bytes the driver lost before they could reach us */
+	if (fp)
+		for (i = 0; i < count; i++)
+			if (fp[i] == TTY_OVERRUN)
+				lunix_stat_inc(LUNIX_STAT_OVERRUNS);
+
+	n = kfifo_in(&ld->fifo, cp, count);
+	if (n < count) {
+		set_bit(LUNIX_LDISC_STALLED, &ld->flags);
+		lunix_stat_inc(LUNIX_STAT_STALLS);
+	}
+	tty->receive_room = kfifo_avail(&ld->fifo);
+
+	/* Falling behind: ask the other end to hold off */
+	if (kfifo_avail(&ld->fifo) < LUNIX_LDISC_THROTTLE &&
+	    !test_bit(TTY_THROTTLED, &tty->flags)) {
+		tty_throttle(tty);
+		lunix_stat_inc(LUNIX_STAT_THROTTLES);
+	}
+
+	schedule_work(&ld->work);
+	return n;
 }
 
 /*
@@ -117,7 +214,7 @@ static struct tty_ldisc_ops lunix_ldisc_ops = {
 	.close =	lunix_ldisc_close,			/* close() */
 	.read =		lunix_ldisc_read,			/* read() */
 	.write =	lunix_ldisc_write,			/* write() */
-	.receive_buf =	lunix_ldisc_receive
+	.receive_buf2 =	lunix_ldisc_receive
 };
 
 int lunix_ldisc_init(void)
@@ -125,7 +222,6 @@ int lunix_ldisc_init(void)
 	int ret;
 
 	debug("initializing lunix ldisc\n");
-	atomic_set(&lunix_disc_available, 1);
 	ret = tty_register_ldisc(N_LUNIX_LDISC, &lunix_ldisc_ops);
 	if (ret)
 		printk(KERN_ERR "%s: Error registering line discipline, ret = %d.\n", __FILE__, ret);
@@ -12,6 +12,9 @@
 #define _LUNIX_LDISC_H
 
 /* Compile-time parameters */
+#define LUNIX_LDISC_FIFO_SIZE	16384	/* Bytes queued for parsing, per TTY; a power of two */
+#define LUNIX_LDISC_THROTTLE	4096	/* Throttle the TTY with less room than this left */
+#define LUNIX_LDISC_UNTHROTTLE	8192	/* and unthrottle it once there is this much again */
 
 #ifdef __KERNEL__ 
 
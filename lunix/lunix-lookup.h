@@ -1,11 +0,0 @@
-/*
- * lunix-tables.h
- *
- * Machine-generated file. DO NOT EDIT.
- * See mk_lookup_tables.c instead.
- *
- * Instead of doing floating-point in kernelspace,
- * use the following lookup tables to convert 16-bit
- * raw measurements to floating point values.
- */
-
@@ -0,0 +1,503 @@
+/*
+ * lunix-parse-bench.c
+ *
+ * Replays a byte trace of a gateway stream through two versions
+ * of the XMesh packet framing state machine of lunix-protocol.c,
+ * in userspace, and compares them:
+ *
+ *   old: the original one, which moves a byte at a time through
+ *        a chain of ifs, one per state;
+ *   new: the table-driven one of lunix-framing.h, which skips to the
+ *        next start byte with memchr() and copies runs of unescaped
+ *        bytes of the payload and CRC a word at a time.
+ *
+ * The trace is either a capture of a real gateway stream [e.g. the
+ * output of lunix-tcp.sh saved to a file], or synthesized, the same
+ * way lunix-sim does. It is fed to each parser in chunks, as the line
+ * discipline does, a number of times over. For each parser, the packets
+ * found, a checksum of their sensor readings and the time per byte are
+ * reported; on a trace of intact packets both must find the same ones.
+ * The new parser also checks CRCs, which the old one never did; -C turns
+ * that off, to compare the framing alone.
+ *
+ *	./lunix-parse-bench -p 10000 -i 100
+ *	./lunix-parse-bench -f capture.bin
+ *
+ * The new state machine is the one the driver runs, from lunix-framing.h;
+ * the old one is a copy of the original code. Calls into the rest of the
+ * driver are replaced by record_packet().
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <sys/stat.h>
+
+#include "lunix-framing.h"
+
+/* Synthesized packets, as in lunix-sim.c */
+#define START_BYTE		0x7E
+#define ESCAPE_BYTE		0x7D
+#define PACKET_TYPE		0x42
+#define AM_TYPE_SENSORS		0x0B
+#define AM_GROUP		0x7D
+#define PAYLOAD_LEN		(LIGHT_OFFSET + 2 - PAYLOAD_OFFSET)
+#define PACKET_LEN		(PAYLOAD_OFFSET + PAYLOAD_LEN + 3)
+
+/* Settings */
+static unsigned int nodes = 16;
+static unsigned int packets = 10000;	/* to synthesize */
+static unsigned int iterations = 100;
+static unsigned int chunk = 256;	/* bytes per call, as in lunix_ldisc_work() */
+static int check_crc = 1;		/* in the new parser; the old one never did */
+static const char *capture;
+
+static unsigned char *trace;
+static size_t trace_len;
+
+/*
+ * What a parser found in the trace
+ */
+struct result {
+	uint64_t packets;
+	uint64_t checksum;
+	uint64_t ns;
+};
+
+static struct result *cur;
+
+static uint16_t uint16_from_packet(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+/*
+ * Stands in for lunix_sensor_update(): fold the readings
+ * of a sensor packet into the checksum of the parser
+ */
+static void record_packet(const unsigned char *packet)
+{
+	uint64_t v;
+
+	v = (uint64_t)uint16_from_packet(&packet[NODE_OFFSET]) << 48 |
+		(uint64_t)uint16_from_packet(&packet[VREF_OFFSET]) << 32 |
+		(uint64_t)uint16_from_packet(&packet[TEMPERATURE_OFFSET]) << 16 |
+		uint16_from_packet(&packet[LIGHT_OFFSET]);
+	cur->checksum = cur->checksum * 31 + v;
+	cur->packets++;
+}
+
+/**********************************************************************
+ * The old state machine
+ **********************************************************************/
+
+/* Its states, as they were in lunix-protocol.h */
+#define OLD_SEEKING_START_BYTE             SEEKING_START_BYTE
+#define OLD_SEEKING_PACKET_TYPE            2
+#define OLD_SEEKING_DESTINATION_ADDRESS    3
+#define OLD_SEEKING_AM_TYPE                4
+#define OLD_SEEKING_AM_GROUP               5
+#define OLD_SEEKING_PAYLOAD_LENGTH         6
+#define OLD_SEEKING_PAYLOAD                7
+#define OLD_SEEKING_CRC                    8
+#define OLD_SEEKING_END_BYTE               9
+
+static int old_parse_state(struct lunix_protocol_state_struct *state,
+	const unsigned char *data, int length, int *i, int use_specials)
+{
+	while ((*i < length) && (state->bytes_read < state->bytes_to_read))
+	{
+		/* Prevent buffer overflows */
+		if (state->pos == MAX_PACKET_LEN) {
+			state->pos = 0;
+			return -1;
+		}
+
+		if (1 == use_specials)
+		{
+			if (state->next_is_special)
+			{
+				if (0x7E == state->next_is_special)
+					state->packet[state->pos] = data[*i];
+				if (0x7D == state->next_is_special)
+					state->packet[state->pos] = data[*i]^0x20;
+				++state->pos;
+				++state->bytes_read;
+				++(*i);
+				state->next_is_special = 0;
+			}
+			else
+			{
+				if ((0x7E == data[*i]) || (0x7D == data[*i]))
+				{
+					state->next_is_special = data[*i];
+					++(*i);
+				} else {
+					state->packet[state->pos] = data[*i];
+					++state->pos;
+					++state->bytes_read;
+					++(*i);
+				}
+			}
+		}
+		else
+		{
+			state->packet[state->pos] = data[*i];
+			++state->pos;
+			++state->bytes_read;
+			++(*i);
+		}
+	}
+
+	if (state->bytes_read == state->bytes_to_read)
+		return 1;
+	return 0;
+}
+
+/*
+ * The original received_buf() stopped after the first packet in the
+ * buffer, dropping the rest. Here it returns how far it got instead,
+ * to be called again for the rest of the buffer.
+ */
+static int old_received_buf(struct lunix_protocol_state_struct *state,
+	const unsigned char *buf, int length)
+{
+	int i;
+	int payload_length;
+
+	i = 0;
+
+	if (state->state == OLD_SEEKING_START_BYTE)
+		if (old_parse_state(state, buf, length, &i, 0) == 1)
+			set_state(state, OLD_SEEKING_PACKET_TYPE, 1, 0);
+
+	if (state->state == OLD_SEEKING_PACKET_TYPE)
+		if (old_parse_state(state, buf, length, &i, 0) == 1)
+			set_state(state, OLD_SEEKING_DESTINATION_ADDRESS, 2, 0);
+
+	if (state->state == OLD_SEEKING_DESTINATION_ADDRESS)
+		if (old_parse_state(state, buf, length, &i, 1) == 1)
+			set_state(state, OLD_SEEKING_AM_TYPE, 1, 0);
+
+	if (state->state == OLD_SEEKING_AM_TYPE)
+		if (old_parse_state(state, buf, length, &i, 1) == 1)
+			set_state(state, OLD_SEEKING_AM_GROUP, 1, 0);
+
+	if (state->state == OLD_SEEKING_AM_GROUP)
+		if (old_parse_state(state, buf, length, &i, 1) == 1)
+			set_state(state, OLD_SEEKING_PAYLOAD_LENGTH, 1, 0);
+
+	if (state->state == OLD_SEEKING_PAYLOAD_LENGTH)
+		if (old_parse_state(state, buf, length, &i, 1) == 1) {
+			payload_length = state->packet[state->pos - 1];
+			set_state(state, OLD_SEEKING_PAYLOAD, payload_length, 0);
+		}
+
+	if (state->state == OLD_SEEKING_PAYLOAD)
+		if (old_parse_state(state, buf, length, &i, 1) == 1)
+			set_state(state, OLD_SEEKING_CRC, 2, 0);
+
+	if (state->state == OLD_SEEKING_CRC)
+		if (old_parse_state(state, buf, length, &i, 1) == 1)
+			set_state(state, OLD_SEEKING_END_BYTE, 1, 0);
+
+	if (state->state == OLD_SEEKING_END_BYTE)
+		if (old_parse_state(state, buf, length, &i, 0) == 1) {
+			if (0x0B == state->packet[PACKET_SIGNATURE_OFFSET])
+				record_packet(state->packet);
+			state->pos = 0;
+			state->next_is_special = 0;
+			set_state(state, OLD_SEEKING_START_BYTE, 1, 0);
+		}
+
+	return i;
+}
+
+static void old_parse(struct lunix_protocol_state_struct *state,
+	const unsigned char *buf, int length)
+{
+	int i;
+
+	for (i = 0; i < length; )
+		i += old_received_buf(state, buf + i, length - i);
+}
+
+/**********************************************************************
+ * The new state machine
+ **********************************************************************/
+
+/*
+ * CRC-16, polynomial 0x1021, MSB first, table-driven
+ * like the kernel's crc_itu_t()
+ */
+static uint16_t crc_itu_t_table[256];
+
+static void crc_itu_t_init(void)
+{
+	int i, j;
+	uint16_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i << 8;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		crc_itu_t_table[i] = crc;
+	}
+}
+
+static uint16_t crc_itu_t(uint16_t crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+		crc = (crc << 8) ^ crc_itu_t_table[(crc >> 8) ^ *p++];
+	return crc;
+}
+
+static int lunix_protocol_crc_ok(struct lunix_protocol_state_struct *state)
+{
+	int crc_pos = state->pos - 3;
+
+	return crc_itu_t(0, &state->packet[1], crc_pos - 1) ==
+		uint16_from_packet(&state->packet[crc_pos]);
+}
+
+/*
+ * As lunix_protocol_received_buf(), with dispatching
+ * and the statistics replaced by record_packet()
+ */
+static void new_parse(struct lunix_protocol_state_struct *state,
+	const unsigned char *buf, int length)
+{
+	int i;
+	int ret;
+	int skipped;
+
+	i = 0;
+	skipped = 0;
+	while ((ret = lunix_protocol_frame(state, buf, length, &i, &skipped)) != LUNIX_FRAME_NONE) {
+		if (ret == LUNIX_FRAME_PACKET &&
+		    (!check_crc || lunix_protocol_crc_ok(state)) &&
+		    0x0B == state->packet[PACKET_SIGNATURE_OFFSET] &&
+		    state->packet[PAYLOAD_LENGTH_OFFSET] >= PAYLOAD_LEN)
+			record_packet(state->packet);
+		lunix_protocol_init(state);
+	}
+}
+
+/**********************************************************************
+ * The harness
+ **********************************************************************/
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-f capture | -p packets [-n nodes]] [-i iterations] [-c chunk] [-C]\n\n"
+		"  -f capture    replay a captured gateway stream\n"
+		"  -p packets    synthesize that many packets [default 10000]\n"
+		"  -n nodes      from node ids 1 to nodes [default 16]\n"
+		"  -i iterations times to go over the trace [default 100]\n"
+		"  -c chunk      bytes handed to the parser at once [default 256]\n"
+		"  -C            skip the CRC check of the new parser, to compare\n"
+		"                framing alone\n",
+		argv0);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int load_capture(const char *path)
+{
+	int fd;
+	ssize_t ret;
+	size_t pos;
+	struct stat st;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	trace_len = st.st_size;
+	trace = malloc(trace_len ? trace_len : 1);
+	if (!trace) {
+		perror("malloc");
+		return -1;
+	}
+	for (pos = 0; pos < trace_len; pos += ret) {
+		ret = read(fd, trace + pos, trace_len - pos);
+		if (ret <= 0) {
+			fprintf(stderr, "%s: short read\n", path);
+			return -1;
+		}
+	}
+	close(fd);
+
+	return 0;
+}
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+/*
+ * Synthesize packets back to back, escaped, with a valid CRC.
+ * The light value is a packet counter, so that every byte value
+ * [start and escape bytes included] turns up in the payload.
+ */
+static int synthesize(void)
+{
+	int i;
+	unsigned int n, node;
+	uint16_t crc;
+	unsigned char pkt[PACKET_LEN];
+
+	trace = malloc((size_t)packets * 2 * PACKET_LEN);
+	if (!trace) {
+		perror("malloc");
+		return -1;
+	}
+
+	trace_len = 0;
+	for (n = 0; n < packets; n++) {
+		node = n % nodes + 1;
+		memset(pkt, 0, sizeof(pkt));
+		pkt[0] = START_BYTE;
+		pkt[1] = PACKET_TYPE;
+		put_le16(&pkt[2], 0xFFFF);
+		pkt[PACKET_SIGNATURE_OFFSET] = AM_TYPE_SENSORS;
+		pkt[5] = AM_GROUP;
+		pkt[PAYLOAD_LENGTH_OFFSET] = PAYLOAD_LEN;
+		put_le16(&pkt[NODE_OFFSET], node);
+		put_le16(&pkt[VREF_OFFSET], 400 + (n / nodes / 1000) % 100);
+		put_le16(&pkt[TEMPERATURE_OFFSET], 500 + (n / nodes + node * 7) % 64);
+		put_le16(&pkt[LIGHT_OFFSET], n & 0xffff);
+
+		crc = crc_itu_t(0, &pkt[1], PAYLOAD_OFFSET + PAYLOAD_LEN - 1);
+		put_le16(&pkt[PAYLOAD_OFFSET + PAYLOAD_LEN], crc);
+		pkt[PACKET_LEN - 1] = START_BYTE;
+
+		trace[trace_len++] = pkt[0];
+		trace[trace_len++] = pkt[1];
+		for (i = 2; i < PACKET_LEN - 1; i++) {
+			if (pkt[i] == START_BYTE || pkt[i] == ESCAPE_BYTE) {
+				trace[trace_len++] = ESCAPE_BYTE;
+				trace[trace_len++] = pkt[i] ^ 0x20;
+			} else
+				trace[trace_len++] = pkt[i];
+		}
+		trace[trace_len++] = pkt[PACKET_LEN - 1];
+	}
+
+	return 0;
+}
+
+/*
+ * Feed the trace to a parser, in chunks, iterations times over.
+ * Packets and checksum are only kept from the first pass.
+ */
+static void run(const char *name, struct result *r,
+	void (*parse)(struct lunix_protocol_state_struct *, const unsigned char *, int))
+{
+	size_t pos, n;
+	unsigned int it;
+	uint64_t start;
+	struct result first;
+	struct lunix_protocol_state_struct state;
+
+	memset(r, 0, sizeof(*r));
+	first = *r;
+	cur = r;
+	lunix_protocol_init(&state);
+
+	start = now_ns();
+	for (it = 0; it < iterations; it++) {
+		for (pos = 0; pos < trace_len; pos += n) {
+			n = trace_len - pos < chunk ? trace_len - pos : chunk;
+			parse(&state, trace + pos, n);
+		}
+		if (it == 0)
+			first = *r;
+	}
+	r->ns = now_ns() - start;
+	r->packets = first.packets;
+	r->checksum = first.checksum;
+
+	printf("%-4s %10" PRIu64 " packets  checksum %016" PRIx64 "  %7.3f ns/byte  %8.1f MB/s\n",
+		name, r->packets, r->checksum,
+		(double)r->ns / ((double)trace_len * iterations),
+		(double)trace_len * iterations / (r->ns / 1e9) / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	struct result old, new;
+
+	while ((c = getopt(argc, argv, "f:p:n:i:c:C")) != -1) {
+		switch (c) {
+		case 'f':
+			capture = optarg;
+			break;
+		case 'p':
+			packets = atoi(optarg);
+			break;
+		case 'n':
+			nodes = atoi(optarg);
+			if (nodes < 1 || nodes > 65535)		/* 16-bit node ids */
+				usage(argv[0]);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			if (iterations < 1)
+				usage(argv[0]);
+			break;
+		case 'c':
+			chunk = atoi(optarg);
+			if (chunk < 1)
+				usage(argv[0]);
+			break;
+		case 'C':
+			check_crc = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	crc_itu_t_init();
+	if (capture ? load_capture(capture) : synthesize())
+		exit(1);
+
+	printf("%zu bytes, %u iterations, %u bytes per call\n", trace_len, iterations, chunk);
+	run("old", &old, old_parse);
+	run("new", &new, new_parse);
+	printf("speedup: %.2fx\n", (double)old.ns / new.ns);
+
+	/*
+	 * The old parser does not check CRCs, and cannot resync:
+	 * they only have to agree on a trace of intact packets.
+	 */
+	if (!capture && (old.packets != new.packets || old.checksum != new.checksum)) {
+		fprintf(stderr, "The parsers disagree\n");
+		return 1;
+	}
+
+	return 0;
+}
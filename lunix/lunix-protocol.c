@@ -15,6 +15,10 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/crc-itu-t.h>
+#include <linux/ratelimit.h>
+#include <linux/err.h>
 #include <asm/byteorder.h>
 
 #include "lunix.h"
@@ -49,158 +53,105 @@ static inline void lunix_protocol_show_packet(struct lunix_protocol_state_struct
 }
 
 /*
- * Receives a complete XMesh packet and updates the node structures if
- * the packet contains sensor information. The function ignores other
- * types of packets. In future releases check packets with packet[4]
- * equal to 0x03, 0xFD for extending this function.
+ * Handlers of complete XMesh packets, one per AM type [packet[4]].
+ * Each one is passed the sensor structure of the node the packet came
+ * from, once the payload is known to be long enough for it.
  */
-static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state, struct lunix_sensor_struct *lunix_sensors)
+struct lunix_protocol_handler {
+	void (*update)(struct lunix_protocol_state_struct *state,
+		struct lunix_sensor_struct *sensor);
+	int min_payload;
+};
+
+/*
+ * Sensor readings: update the measurements of the node
+ */
+static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state,
+	struct lunix_sensor_struct *sensor)
 {
 	uint16_t batt;
 	uint16_t temp;
 	uint16_t light;
-	uint16_t nodeid;
 
-	//debug("WHOLE PACKET\n");
+	batt = uint16_from_packet(&state->packet[VREF_OFFSET]);
+	temp = uint16_from_packet(&state->packet[TEMPERATURE_OFFSET]);
+	light = uint16_from_packet(&state->packet[LIGHT_OFFSET]);
 
-	if (0x0B == state->packet[PACKET_SIGNATURE_OFFSET])
-	{
-		nodeid = uint16_from_packet(&state->packet[NODE_OFFSET]);
-		batt = uint16_from_packet(&state->packet[VREF_OFFSET]);
-		temp = uint16_from_packet(&state->packet[TEMPERATURE_OFFSET]);
-		light = uint16_from_packet(&state->packet[LIGHT_OFFSET]);
-		
-		/* FIXME */
-		//debug ("I have the following raw data from nodeid = %d: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
-		//	nodeid, batt, temp, light);
+	/* FIXME */
+	//debug ("I have the following raw data: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
+	//	batt, temp, light);
 
-		if (nodeid > 0 && nodeid <= lunix_sensor_cnt)
-			lunix_sensor_update(&lunix_sensors[nodeid - 1], batt, temp, light);
-		else
-			printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
-				nodeid, lunix_sensor_cnt);
-	}
+	lunix_sensor_update(sensor, batt, temp, light);
 }
 
-/**********************************************************************************
- * PACKET STRUCTURE						
- * BYTE				VALUE		MEANING
- * 0				0x7E		Packet Start byte signature
- * 1				0x??		Packet Type
- * 2-3				0x??		Destination Address
- * 4				0x??		AM Type
- * 5				0x??		AM Group
- * 6				0x??		Payload length (PL)
- * 7-(7 + PL-1)			0x??		PayLoad
- * (7 + PL)-(7 + PL + 1)	0x??		CRC
- * (7 + PL + 2)			0X7E		Packet End byte signature
- **********************************************************************************/
-
 /*
- * Helper function to quickly set the current state
+ * Mesh health and routing packets: keep their payload
+ * as the latest one of its kind from the node
  */
-static inline void set_state(struct lunix_protocol_state_struct *statep, int state, int btr, int br)
+static void lunix_protocol_update_health(struct lunix_protocol_state_struct *state,
+	struct lunix_sensor_struct *sensor)
 {
-	//debug("switching to state %d, bytes_to_read = %d, bytes_read = %d\n",
-	//	state, btr, br);
-	statep->state = state;
-	statep->bytes_to_read = btr;
-	statep->bytes_read = br;
-	//lunix_protocol_show_packet(statep);
+	lunix_sensor_store_msg(sensor, HEALTH, &state->packet[PAYLOAD_OFFSET],
+		state->packet[PAYLOAD_LENGTH_OFFSET]);
 }
 
-/*
- * Initialization of protocol state machine
- */
-void lunix_protocol_init(struct lunix_protocol_state_struct *state)
+static void lunix_protocol_update_route(struct lunix_protocol_state_struct *state,
+	struct lunix_sensor_struct *sensor)
 {
-	state->pos = 0;
-	state->next_is_special = 0;
-	set_state(state, SEEKING_START_BYTE, 1, 0);
+	lunix_sensor_store_msg(sensor, ROUTE, &state->packet[PAYLOAD_OFFSET],
+		state->packet[PAYLOAD_LENGTH_OFFSET]);
 }
 
+static const struct lunix_protocol_handler lunix_protocol_handlers[256] = {
+	[0x0B] = { lunix_protocol_update_sensors, LIGHT_OFFSET + 2 - PAYLOAD_OFFSET },
+	[0x03] = { lunix_protocol_update_health, NODE_OFFSET + 2 - PAYLOAD_OFFSET },
+	[0xFD] = { lunix_protocol_update_route, NODE_OFFSET + 2 - PAYLOAD_OFFSET },
+};
+
 /*
- * Crucial function for parsing the input packet according
- * to the current state.
- *
- * struct lunix_protocol_state_struct *state: 
- * unsigned char *data: the data received
- * int length: the amount of bytes received
- * int *i: the pointer to the data received is updated when data are 
- *         transferred to the unparsed_packet array
- * int use_specials: if 1 special characters are treated acc
+ * Receives a complete XMesh packet and passes it on to the handler
+ * of its AM type, if any, along with the node it came from.
+ * Packets of other types are ignored.
  */
-static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
-	const unsigned char *data, int length, int *i, int use_specials)
+static void lunix_protocol_dispatch(struct lunix_protocol_state_struct *state)
 {
-	int iter;
+	uint16_t nodeid;
+	struct lunix_sensor_struct *sensor;
+	const struct lunix_protocol_handler *handler;
 
-	//debug("entering, for *i = %d, length = %d, state = %d, btr = %d, br = %d, next_is_special = %d\n",
-	//	*i, length, state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
+	//debug("WHOLE PACKET\n");
 
-	iter = 0;
-	while ((*i < length) && (state->bytes_read < state->bytes_to_read))
-	{
-#if LUNIX_DEBUG
-		if (++iter == 50) {
-			debug("OOPS!\n");
-			return -1;
-		}
-#endif
-		/* Prevent buffer overflows */
-		if (state->pos == MAX_PACKET_LEN) {
-			printk(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
-				"packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
-			printk(KERN_ERR "How will I ever resync with the input stream?\n");
-			state->pos = 0;
-			return -1;
-		}
+	handler = &lunix_protocol_handlers[state->packet[PACKET_SIGNATURE_OFFSET]];
+	if (!handler->update)
+		return;
+	if (state->packet[PAYLOAD_LENGTH_OFFSET] < handler->min_payload) {
+		lunix_stat_inc(LUNIX_STAT_FRAMING_ERRORS);
+		return;
+	}
 
-		if (1 == use_specials)
-		{
-			if (state->next_is_special)
-			{
-				if (0x7E == state->next_is_special)
-					state->packet[state->pos] = data[*i];
-				if (0x7D == state->next_is_special)
-					state->packet[state->pos] = data[*i]^0x20;
-				++state->pos;
-				++state->bytes_read;
-				++(*i);
-				state->next_is_special = 0;
-			}
-			else
-			{
-				if ((0x7E == data[*i]) || (0x7D == data[*i]))
-				{
-					state->next_is_special = data[*i];
-					++(*i);
-				} else {
-					state->packet[state->pos] = data[*i];
-					++state->pos;
-					++state->bytes_read;
-					++(*i);
-				}
-			}
-		}
-		else
-		{
-			state->packet[state->pos] = data[*i];
-			++state->pos;
-			++state->bytes_read;
-			++(*i);
-		}
+	nodeid = uint16_from_packet(&state->packet[NODE_OFFSET]);
+	sensor = lunix_sensor_get(nodeid);
+	if (!IS_ERR(sensor)) {
+		lunix_sensor_link(sensor, state->gateway);
+		handler->update(state, sensor);
+	} else {
+		lunix_stat_inc(LUNIX_STAT_DROPPED_NODES);
+		printk_ratelimited(KERN_WARNING "Dropping packet from node id %d [maximum %d sensors]\n",
+			nodeid, lunix_sensor_cnt);
 	}
+}
 
-	if (state->bytes_read == state->bytes_to_read) {
-		//debug("returning 1 from state = %d, btr = %d, br = %d, next_is_special = %d\n",
-		//	state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
-		return 1;
-	}	
+/*
+ * Checks the CRC of a complete packet. It is the CRC-16/CCITT
+ * [polynomial 0x1021, initial value 0] of everything between the
+ * start byte and the CRC itself, stored little-endian.
+ */
+static int lunix_protocol_crc_ok(struct lunix_protocol_state_struct *state)
+{
+	int crc_pos = state->pos - 3;
 
-	//debug("returning 0 from state = %d, btr = %d, br = %d, next_is_special = %d\n",
-	//	state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
-	return 0;
+	return crc_itu_t(0, &state->packet[1], crc_pos - 1) ==
+		uint16_from_packet(&state->packet[crc_pos]);
 }
 
 /*
@@ -212,54 +163,38 @@ int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
 	const unsigned char *buf, int length)
 {
 	int i;
-	int payload_length;
+	int ret;
+	int skipped;
 
 	i = 0;
-
-	if (state->state == SEEKING_START_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
-
-
-	if (state->state == SEEKING_PACKET_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
-
-	if (state->state == SEEKING_DESTINATION_ADDRESS) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_TYPE, 1, 0);
-
-	if (state->state == SEEKING_AM_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_GROUP, 1, 0);
-
-	if (state->state == SEEKING_AM_GROUP) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
-
-	if (state->state == SEEKING_PAYLOAD_LENGTH) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
-			payload_length = state->packet[state->pos - 1];
-			set_state(state, SEEKING_PAYLOAD, payload_length, 0);
-		}
-
-	if (state->state == SEEKING_PAYLOAD) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_CRC, 2, 0);
-
-	if (state->state == SEEKING_CRC) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_END_BYTE, 1, 0);
-
-	if (state->state == SEEKING_END_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
-			//debug("An XMesh packet has been received, updating sensors\n");
-
-			lunix_protocol_update_sensors(state, lunix_sensors);
-			state->pos = 0;
-			state->next_is_special = 0;
-			set_state(state, SEEKING_START_BYTE, 1, 0);
+	skipped = 0;
+	lunix_stat_add(LUNIX_STAT_BYTES, length);
+
+	/*
+	 * The buffer may hold any number of packets, or parts of them:
+	 * keep going until every byte in it has been consumed.
+	 */
+	while ((ret = lunix_protocol_frame(state, buf, length, &i, &skipped)) != LUNIX_FRAME_NONE) {
+		switch (ret) {
+		case LUNIX_FRAME_PACKET:
+			if (!lunix_protocol_crc_ok(state))
+				lunix_stat_inc(LUNIX_STAT_CRC_ERRORS);
+			else {
+				//debug("An XMesh packet has been received, updating sensors\n");
+				lunix_stat_inc(LUNIX_STAT_FRAMES);
+				lunix_protocol_dispatch(state);
+			}
+			break;
+		case LUNIX_FRAME_OVERFLOW:
+			lunix_stat_inc(LUNIX_STAT_OVERFLOWS);
+			break;
+		case LUNIX_FRAME_ERROR:
+			lunix_stat_inc(LUNIX_STAT_FRAMING_ERRORS);
+			break;
 		}
+		lunix_protocol_init(state);
+	}
+	lunix_stat_add(LUNIX_STAT_SKIPPED, skipped);
 
 	//debug("leaving\n");
 
@@ -22,32 +22,54 @@
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/radix-tree.h>
+#include <linux/err.h>
+#include <linux/math64.h>
+#include <linux/timekeeping.h>
 
 #include "lunix.h"
+#include "lunix-tables.h"
+
+/*
+ * The sensors created so far, indexed by node id. Lookups are lockless
+ * [under RCU], insertions are serialized by lunix_sensor_tree_lock.
+ * Sensors are only removed, and freed, when the module is unloaded.
+ */
+static RADIX_TREE(lunix_sensor_tree, GFP_ATOMIC);
+static DEFINE_SPINLOCK(lunix_sensor_tree_lock);
+static int lunix_sensor_live;
 
 /*
  * Initialization and destruction of sensor structures
- * Invoked from: lunix-module.c
- *      module_init(lunix_module_init);
- *      module_exit(lunix_module_cleanup);
+ * Invoked from: lunix_sensor_get(), lunix_sensor_destroy_all()
  */
-int lunix_sensor_init(struct lunix_sensor_struct *s)
+static int lunix_sensor_init(struct lunix_sensor_struct *s)
 {
 	int i;
 	int ret;
 	unsigned long p;
 
+	BUILD_BUG_ON(sizeof(struct lunix_msr_data_struct) > PAGE_SIZE);
+	BUILD_BUG_ON(offsetof(struct lunix_msr_data_struct, stats) != 40);
+	BUILD_BUG_ON(offsetof(struct lunix_msr_data_struct, ring) != 72);
+	BUILD_BUG_ON(LUNIX_MSR_RING_LEN & (LUNIX_MSR_RING_LEN - 1));
+
 	/*
 	 * Initialize structure fields
 	 */
 	spin_lock_init(&s->lock);           /* linux/spinlock.h */
 	init_waitqueue_head(&s->wq);
+	for (i = 0; i < N_LUNIX_MSG; i++)
+		init_waitqueue_head(&s->msg_wq[i]);
 
 	/*
 	 * Allocate one page per measurement buffer
 	 */
 	for (i = 0; i < N_LUNIX_MSR; i++)
 		s->msr_data[i] = NULL;
+	for (i = 0; i < N_LUNIX_MSG; i++)
+		s->msg_data[i] = NULL;
 
 	for (i = 0; i < N_LUNIX_MSR; i++) {
 		p = get_zeroed_page(GFP_KERNEL);
@@ -57,6 +79,18 @@ int lunix_sensor_init(struct lunix_sensor_struct *s)
 		}
 		s->msr_data[i] = (struct lunix_msr_data_struct *)p;
 		s->msr_data[i]->magic = LUNIX_MSR_MAGIC;
+		s->msr_data[i]->version = LUNIX_MSR_VERSION;
+	}
+
+	/*
+	 * And a buffer for every other kind of packet
+	 */
+	for (i = 0; i < N_LUNIX_MSG; i++) {
+		s->msg_data[i] = kzalloc(sizeof(*s->msg_data[i]), GFP_KERNEL);
+		if (!s->msg_data[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
 	}
 
 	ret = 0;
@@ -69,7 +103,7 @@ out:
  * deallocate all memory and free resources
  * when `modprobe -r <lunix_driver>`
  */
-void lunix_sensor_destroy(struct lunix_sensor_struct *s)
+static void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 {
 	int i;
 
@@ -77,32 +111,413 @@ void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 		if (s->msr_data[i])
 			free_page((unsigned long)s->msr_data[i]);
 	}
+	for (i = 0; i < N_LUNIX_MSG; i++)
+		kfree(s->msg_data[i]);
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		kfree(rcu_access_pointer(s->calib[i]));
+}
+
+/*
+ * Returns the sensor of a node, or NULL if none has been created yet
+ */
+struct lunix_sensor_struct *lunix_sensor_lookup(uint16_t nodeid)
+{
+	struct lunix_sensor_struct *s;
+
+	rcu_read_lock();
+	s = radix_tree_lookup(&lunix_sensor_tree, nodeid);
+	rcu_read_unlock();
+
+	return s;
+}
+
+/*
+ * Returns the sensor of a node, creating it if this is the first time
+ * the node is seen. May sleep. Fails with -ENOSPC once lunix_sensor_cnt
+ * sensors exist, before allocating anything: once the cap is reached,
+ * packets from unknown nodes cost no more than a lookup.
+ */
+struct lunix_sensor_struct *lunix_sensor_get(uint16_t nodeid)
+{
+	int ret;
+	struct lunix_sensor_struct *s;
+
+	if (nodeid == 0)
+		return ERR_PTR(-ENODEV);
+
+	s = lunix_sensor_lookup(nodeid);
+	if (s)
+		return s;
+
+	/* Checked again under the lock, this is only a hint */
+	if (READ_ONCE(lunix_sensor_live) >= lunix_sensor_cnt)
+		return ERR_PTR(-ENOSPC);
+
+	ret = -ENOMEM;
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		goto out;
+	s->nodeid = nodeid;
+	ret = lunix_sensor_init(s);
+	if (ret < 0)
+		goto out_with_sensor;
+
+	ret = radix_tree_preload(GFP_KERNEL);
+	if (ret < 0)
+		goto out_with_sensor;
+
+	spin_lock(&lunix_sensor_tree_lock);
+	if (lunix_sensor_live >= lunix_sensor_cnt)
+		ret = -ENOSPC;
+	else
+		ret = radix_tree_insert(&lunix_sensor_tree, nodeid, s);
+	if (ret == 0)
+		WRITE_ONCE(lunix_sensor_live, lunix_sensor_live + 1);
+	spin_unlock(&lunix_sensor_tree_lock);
+	radix_tree_preload_end();
+
+	if (ret == 0)
+		return s;
+
+out_with_sensor:
+	lunix_sensor_destroy(s);
+	kfree(s);
+out:
+	/* Lost a race with someone creating the same sensor? */
+	if (ret == -EEXIST)
+		return lunix_sensor_lookup(nodeid);
+	return ERR_PTR(ret);
+}
+
+/*
+ * Fill sensors with up to max sensors, in order of node id,
+ * starting from node first. Returns the number of sensors found.
+ */
+unsigned int lunix_sensor_gang_lookup(struct lunix_sensor_struct **sensors,
+	uint16_t first, unsigned int max)
+{
+	unsigned int n;
+
+	rcu_read_lock();
+	n = radix_tree_gang_lookup(&lunix_sensor_tree, (void **)sensors, first, max);
+	rcu_read_unlock();
+
+	return n;
+}
+
+/*
+ * Destroy all sensors, on module unload
+ */
+void lunix_sensor_destroy_all(void)
+{
+	unsigned int i, n;
+	struct lunix_sensor_struct *sensors[16];
+
+	while ((n = lunix_sensor_gang_lookup(sensors, 0, ARRAY_SIZE(sensors))) > 0) {
+		for (i = 0; i < n; i++) {
+			radix_tree_delete(&lunix_sensor_tree, sensors[i]->nodeid);
+			lunix_sensor_destroy(sensors[i]);
+			kfree(sensors[i]);
+		}
+	}
+	lunix_sensor_live = 0;
+}
+
+/*
+ * Note the gateway a packet from the node has come through,
+ * reconnecting the sensor if it had been disconnected
+ */
+void lunix_sensor_link(struct lunix_sensor_struct *s, unsigned long gateway)
+{
+	if (READ_ONCE(s->gateway) == gateway && !READ_ONCE(s->disconnected))
+		return;
+
+	spin_lock(&s->lock);
+	s->gateway = gateway;
+	WRITE_ONCE(s->disconnected, 0);
+	spin_unlock(&s->lock);
+}
+
+/*
+ * A gateway has gone away: disconnect the sensors last heard from
+ * through it, and wake up all their readers to notice. If it was the
+ * last one, no packet can arrive for sensors never heard from either
+ * [created by open()], so disconnect those too.
+ */
+void lunix_sensor_disconnect(unsigned long gateway, int last)
+{
+	int i, gone;
+	unsigned int j, n;
+	uint16_t first;
+	struct lunix_sensor_struct *s, *sensors[16];
+
+	first = 0;
+	while ((n = lunix_sensor_gang_lookup(sensors, first, ARRAY_SIZE(sensors))) > 0) {
+		for (j = 0; j < n; j++) {
+			s = sensors[j];
+
+			spin_lock(&s->lock);
+			gone = (s->gateway == gateway || (last && !s->gateway));
+			if (gone) {
+				s->gateway = 0;
+				WRITE_ONCE(s->disconnected, 1);
+			}
+			spin_unlock(&s->lock);
+
+			if (!gone)
+				continue;
+			wake_up_interruptible(&s->wq);
+			for (i = 0; i < N_LUNIX_MSG; i++)
+				wake_up_interruptible(&s->msg_wq[i]);
+		}
+		if (sensors[n - 1]->nodeid == LUNIX_MAX_NODES)
+			break;
+		first = sensors[n - 1]->nodeid + 1;
+	}
+}
+
+/*
+ * Account for a new value in the running statistics of a measurement
+ */
+static inline void lunix_msr_stats_add(struct lunix_msr_stats *st, int32_t value)
+{
+	int64_t fixed, delta;
+
+	fixed = (int64_t)value * (1 << LUNIX_EWMA_FRAC);
+	if (st->count == 0) {
+		st->min = st->max = value;
+		st->ewma = fixed;
+	} else {
+		if (value < st->min)
+			st->min = value;
+		if (value > st->max)
+			st->max = value;
+		delta = fixed - st->ewma;
+		st->ewma += delta >> LUNIX_EWMA_WEIGHT;
+	}
+	st->count++;
+	st->sum += value;
+}
+
+/*
+ * Convert a raw measurement to thousandths of the unit, through the
+ * calibration table of the measurement if there is one, or through
+ * the built-in conversion otherwise
+ */
+static int32_t lunix_calib_apply(const struct lunix_calib_table *calib, uint16_t raw)
+{
+	uint32_t idx, frac;
+	int32_t lo, hi;
+
+	idx = raw >> calib->shift;
+	if (idx >= calib->cnt - 1)
+		return calib->table[calib->cnt - 1];
+
+	/* Interpolate between the two entries raw falls between */
+	frac = raw & ((1U << calib->shift) - 1);
+	lo = calib->table[idx];
+	hi = calib->table[idx + 1];
+	return lo + (int32_t)((((int64_t)hi - lo) * frac) >> calib->shift);
+}
+
+static int32_t lunix_sensor_cook(struct lunix_sensor_struct *s,
+	enum lunix_msr_enum type, uint16_t raw)
+{
+	int32_t value;
+	struct lunix_calib_table *calib;
+
+	rcu_read_lock();
+	calib = rcu_dereference(s->calib[type]);
+	if (calib) {
+		value = lunix_calib_apply(calib, raw);
+		rcu_read_unlock();
+		return value;
+	}
+	rcu_read_unlock();
+
+	switch (type) {
+	case BATT:
+		return lookup_voltage[min_t(uint16_t, raw, LUNIX_ADC_MAX)];
+	case TEMP:
+		return lookup_temperature[min_t(uint16_t, raw, LUNIX_ADC_MAX)];
+	default:
+		/* Light: a linear conversion over the 16-bit range */
+		return div_u64((uint64_t)raw * 5000000, 65535);
+	}
+}
+
+/*
+ * Store a new value in a measurement page, appending it to the
+ * ring of past samples. Called with the sensor spinlock held.
+ */
+static inline void lunix_msr_store(struct lunix_msr_data_struct *msr,
+	uint32_t value, int32_t cooked, uint32_t now, uint64_t now_ns)
+{
+	struct lunix_msr_sample *sample;
+
+	sample = &msr->ring[msr->head & (LUNIX_MSR_RING_LEN - 1)];
+	sample->timestamp = now_ns;
+	sample->serial = ++msr->head;
+	sample->value = value;
+	sample->cooked = cooked;
+
+	msr->values[0] = value;
+	msr->cooked = cooked;
+	lunix_msr_stats_add(&msr->stats, cooked);
+	msr->last_update = now;
+	msr->timestamp = now_ns;
 }
 
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light)
 {
+	int i;
+	int32_t cooked[N_LUNIX_MSR];
+	uint32_t now;
+	uint64_t now_ns;
+
+	/*
+	 * Convert the new values once, for all readers,
+	 * before taking the spinlock
+	 */
+	cooked[BATT] = lunix_sensor_cook(s, BATT, batt);
+	cooked[TEMP] = lunix_sensor_cook(s, TEMP, temp);
+	cooked[LIGHT] = lunix_sensor_cook(s, LIGHT, light);
+
     /*
      * spinlock: - should be small and fast
      *           - atomic update
      */
 	spin_lock(&s->lock);
+
+	/*
+	 * Mark the pages as being updated, so that lockless
+	 * readers mapping them to userspace retry.
+	 */
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		s->msr_data[i]->seq++;
+	smp_wmb();
 	
 	/* Critical Section:
 	 * Update the raw values and the relevant timestamps.
 	 */
-	s->msr_data[BATT]->values[0] = batt;    /* battery measurements */
-	s->msr_data[TEMP]->values[0] = temp;    /* temperature measurements */
-	s->msr_data[LIGHT]->values[0] = light;  /* light measurements */
+	now = get_seconds();
+	now_ns = ktime_get_ns();
+	lunix_msr_store(s->msr_data[BATT], batt, cooked[BATT], now, now_ns);    /* battery measurements */
+	lunix_msr_store(s->msr_data[TEMP], temp, cooked[TEMP], now, now_ns);    /* temperature measurements */
+	lunix_msr_store(s->msr_data[LIGHT], light, cooked[LIGHT], now, now_ns);  /* light measurements */
 
-	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;  /* LUNIX_MSR_MAGIC =>> 0xFOODFOOD */
-	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = get_seconds();
+	smp_wmb();
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		s->msr_data[i]->seq++;
 	
 	spin_unlock(&s->lock);
 
 	/*
-	 * And wake up any sleepers who may be waiting on
-	 * fresh data from this sensor (stored in spinlock's `s` waitqueue `wq`.
+	 * And wake up any sleepers who may be waiting on fresh data
+	 * from this sensor. Their wakeup filters decide whether they
+	 * actually get to run [see lunix_chrdev_wake_function()].
 	 */
 	wake_up_interruptible(&s->wq);
 }
+
+/*
+ * Copy out the statistics of a measurement, optionally restarting them
+ * so that successive calls report on disjoint windows. A plain copy is
+ * lockless; copying and restarting take the sensor spinlock, so that
+ * every sample is counted in exactly one window.
+ */
+void lunix_sensor_read_stats(struct lunix_sensor_struct *s,
+	enum lunix_msr_enum type, struct lunix_msr_stats *stats, int reset)
+{
+	uint32_t seq;
+	struct lunix_msr_data_struct *msr = s->msr_data[type];
+
+	if (!reset) {
+		do {
+			seq = lunix_msr_read_begin(msr);
+			*stats = msr->stats;
+		} while (lunix_msr_read_retry(msr, seq));
+		return;
+	}
+
+	spin_lock(&s->lock);
+	msr->seq++;
+	smp_wmb();
+	*stats = msr->stats;
+	memset(&msr->stats, 0, sizeof(msr->stats));
+	smp_wmb();
+	msr->seq++;
+	spin_unlock(&s->lock);
+}
+
+/*
+ * Keep a packet other than sensor readings as the latest of its kind
+ * received from the node, and wake up its readers.
+ */
+void lunix_sensor_store_msg(struct lunix_sensor_struct *s,
+	enum lunix_msg_enum type, const unsigned char *payload, int len)
+{
+	struct lunix_msg_data_struct *msg = s->msg_data[type];
+
+	spin_lock(&s->lock);
+	msg->seq++;
+	smp_wmb();
+
+	memcpy(msg->payload, payload, len);
+	msg->len = len;
+	msg->serial++;
+
+	smp_wmb();
+	msg->seq++;
+	spin_unlock(&s->lock);
+
+	wake_up_interruptible(&s->msg_wq[type]);
+}
+
+/*
+ * Copy out the latest packet of a kind, which must be at least
+ * LUNIX_MSG_MAXLEN bytes long, without taking the sensor spinlock
+ * [see lunix_msr_read_begin()]. Returns the length of the payload,
+ * and its serial in *serial.
+ */
+int lunix_sensor_read_msg(struct lunix_sensor_struct *s,
+	enum lunix_msg_enum type, unsigned char *payload, uint32_t *serial)
+{
+	int len;
+	uint32_t seq;
+	struct lunix_msg_data_struct *msg = s->msg_data[type];
+
+	do {
+		while ((seq = READ_ONCE(msg->seq)) & 1)
+			cpu_relax();
+		smp_rmb();
+
+		len = min_t(uint32_t, READ_ONCE(msg->len), LUNIX_MSG_MAXLEN);
+		memcpy(payload, msg->payload, len);
+		*serial = msg->serial;
+
+		smp_rmb();
+	} while (READ_ONCE(msg->seq) != seq);
+
+	return len;
+}
+
+/*
+ * Replace the calibration table of a measurement [NULL restores the
+ * built-in conversion]. It applies to values received from now on.
+ * The old table is freed once no conversion can be using it.
+ */
+void lunix_sensor_set_calib(struct lunix_sensor_struct *s,
+	enum lunix_msr_enum type, struct lunix_calib_table *calib)
+{
+	struct lunix_calib_table *old;
+
+	spin_lock(&s->lock);
+	old = rcu_dereference_protected(s->calib[type], lockdep_is_held(&s->lock));
+	rcu_assign_pointer(s->calib[type], calib);
+	spin_unlock(&s->lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+}
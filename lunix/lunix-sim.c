@@ -0,0 +1,498 @@
+/*
+ * lunix-sim.c
+ *
+ * Traffic generator for the Lunix:TNG driver, for testing without
+ * a sensor network. Creates a pseudo-terminal and writes XMesh packets
+ * to its master side. Attach the driver to the slave side, whose name
+ * is printed on startup, with lunix-attach:
+ *
+ *	./lunix-sim -n 16 -r 1000 &
+ *	./lunix-attach /dev/pts/N
+ *
+ * Packets are either synthesized, for any number of nodes, or replayed
+ * from a capture of a real gateway stream [e.g. the output of lunix-tcp.sh
+ * saved to a file]. Throughput is reported every second.
+ *
+ * Synthesized packets carry a running packet counter as their light
+ * measurement. Given a device node to read from, e.g. /dev/lunix0-light,
+ * the end-to-end latency of every sample read is measured as well, split
+ * into the time until the driver stores the sample [its timestamp] and
+ * the time until a reader gets it.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "lunix.h"
+#include "lunix-chrdev.h"
+
+/*
+ * XMesh packet, as expected by lunix-protocol.c: everything between
+ * the start and end bytes is escaped, except for the packet type.
+ */
+#define START_BYTE		0x7E
+#define ESCAPE_BYTE		0x7D
+#define PACKET_TYPE		0x42	/* P_PACKET_NO_ACK */
+#define AM_TYPE_SENSORS		0x0B
+#define AM_GROUP		0x7D	/* the TinyOS default, needs escaping */
+
+#define PACKET_SIGNATURE_OFFSET	4
+#define PAYLOAD_LENGTH_OFFSET	6
+#define PAYLOAD_OFFSET		7
+#define NODE_OFFSET		9
+#define VREF_OFFSET		18
+#define TEMPERATURE_OFFSET	20
+#define LIGHT_OFFSET		22
+#define PAYLOAD_LEN		(LIGHT_OFFSET + 2 - PAYLOAD_OFFSET)
+#define PACKET_LEN		(PAYLOAD_OFFSET + PAYLOAD_LEN + 3)
+
+#define MAX_ESCAPED_LEN		(2 * PACKET_LEN)
+#define WRITE_BUFSZ		4096	/* bytes handed to the pty at once */
+
+static int master_fd = -1;
+static volatile sig_atomic_t stop;
+
+/* Settings */
+static unsigned int nodes = 16;
+static unsigned int rate = 100;		/* packets per second, 0 for no limit */
+static unsigned int duration;		/* seconds, 0 for no limit */
+static const char *capture;
+static const char *latency_dev;
+
+/* Capture to replay */
+static unsigned char *cap_data;
+static size_t cap_len, cap_pos;
+
+/*
+ * Counters. Send times are indexed by the light value of the packet,
+ * i.e. the packet counter modulo 2^16.
+ */
+static uint64_t pkts_sent, bytes_sent;
+static uint64_t send_ns[65536];
+
+struct lat_stats {
+	uint64_t cnt;
+	uint64_t sum, min, max;
+};
+
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lat_stats lat_driver, lat_total;
+static uint64_t lat_unknown;
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-n nodes] [-r rate] [-t seconds] [-f capture] [-l device] [-w seconds]\n\n"
+		"  -n nodes    synthesize packets from node ids 1 to nodes [default 16]\n"
+		"  -r rate     packets per second, 0 for as fast as possible [default 100]\n"
+		"  -t seconds  stop after that long [default: until interrupted]\n"
+		"  -f capture  replay the packets of a captured gateway stream, repeatedly\n"
+		"  -l device   measure latency reading from device, e.g. /dev/lunix0-light\n"
+		"  -w seconds  start after that long, instead of when Enter is pressed\n",
+		argv0);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * CRC-16, polynomial 0x1021, MSB first [the kernel's crc_itu_t()]
+ */
+static uint16_t crc_itu_t(uint16_t crc, const unsigned char *p, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *p++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+/*
+ * Build the next synthesized packet, escaped, into out.
+ * Returns its length.
+ */
+static int make_packet(unsigned char *out, uint64_t n)
+{
+	int i, len;
+	uint16_t crc;
+	unsigned char pkt[PACKET_LEN];
+	unsigned int node = n % nodes + 1;
+
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0] = START_BYTE;
+	pkt[1] = PACKET_TYPE;
+	put_le16(&pkt[2], 0xFFFF);
+	pkt[PACKET_SIGNATURE_OFFSET] = AM_TYPE_SENSORS;
+	pkt[5] = AM_GROUP;
+	pkt[PAYLOAD_LENGTH_OFFSET] = PAYLOAD_LEN;
+	put_le16(&pkt[NODE_OFFSET], node);
+
+	/* A slowly draining battery, a temperature swinging around 20 C */
+	put_le16(&pkt[VREF_OFFSET], 400 + (n / nodes / 1000) % 100);
+	put_le16(&pkt[TEMPERATURE_OFFSET], 500 + (n / nodes + node * 7) % 64);
+	put_le16(&pkt[LIGHT_OFFSET], n & 0xffff);
+
+	crc = crc_itu_t(0, &pkt[1], PAYLOAD_OFFSET + PAYLOAD_LEN - 1);
+	put_le16(&pkt[PAYLOAD_OFFSET + PAYLOAD_LEN], crc);
+	pkt[PACKET_LEN - 1] = START_BYTE;
+
+	len = 0;
+	out[len++] = pkt[0];
+	out[len++] = pkt[1];
+	for (i = 2; i < PACKET_LEN - 1; i++) {
+		if (pkt[i] == START_BYTE || pkt[i] == ESCAPE_BYTE) {
+			out[len++] = ESCAPE_BYTE;
+			out[len++] = pkt[i] ^ 0x20;
+		} else
+			out[len++] = pkt[i];
+	}
+	out[len++] = pkt[PACKET_LEN - 1];
+
+	return len;
+}
+
+/*
+ * Point *out to the next packet of the capture, from its start byte
+ * to its end byte, wrapping around at the end. Returns its length,
+ * or 0 if the capture holds no packets.
+ */
+static int next_captured(unsigned char **out)
+{
+	size_t start, end, tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		start = cap_pos;
+		while (start < cap_len && cap_data[start] != START_BYTE)
+			start++;
+		end = start + 1;
+		while (end < cap_len && cap_data[end] == START_BYTE)
+			start = end++;
+		while (end < cap_len && cap_data[end] != START_BYTE)
+			end++;
+		if (end < cap_len) {
+			cap_pos = end + 1;
+			*out = cap_data + start;
+			return end + 1 - start;
+		}
+		cap_pos = 0;
+	}
+
+	return 0;
+}
+
+static int load_capture(const char *path)
+{
+	int fd;
+	ssize_t ret;
+	struct stat st;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	cap_len = st.st_size;
+	cap_data = malloc(cap_len ? cap_len : 1);
+	if (!cap_data) {
+		perror("malloc");
+		return -1;
+	}
+	for (cap_pos = 0; cap_pos < cap_len; cap_pos += ret) {
+		ret = read(fd, cap_data + cap_pos, cap_len - cap_pos);
+		if (ret <= 0) {
+			fprintf(stderr, "%s: short read\n", path);
+			return -1;
+		}
+	}
+	cap_pos = 0;
+	close(fd);
+
+	return 0;
+}
+
+static void write_all(const unsigned char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0 && !stop) {
+		ret = write(master_fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write to pty");
+			exit(1);
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static void lat_add(struct lat_stats *s, uint64_t v)
+{
+	if (!s->cnt || v < s->min)
+		s->min = v;
+	if (v > s->max)
+		s->max = v;
+	s->sum += v;
+	s->cnt++;
+}
+
+/*
+ * Latency measurement: read every sample of the device node in
+ * BINARY mode, and look up when the packet it came from was sent.
+ */
+static void *latency_reader(void *arg)
+{
+	int fd, mode, one, i, n;
+	ssize_t ret;
+	uint64_t sent, now;
+	struct lunix_record recs[64];
+
+	fd = open(latency_dev, O_RDONLY);
+	if (fd < 0) {
+		perror(latency_dev);
+		exit(1);
+	}
+	mode = BINARY;
+	one = 1;
+	if (ioctl(fd, LUNIX_IOC_SET_MODE, &mode) < 0 ||
+	    ioctl(fd, LUNIX_IOC_HISTORY, &one) < 0) {
+		perror("ioctl on latency device");
+		exit(1);
+	}
+
+	while (!stop) {
+		ret = read(fd, recs, sizeof(recs));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read from latency device");
+			exit(1);
+		}
+		if (ret == 0)
+			break;	/* gateway detached */
+
+		now = now_ns();
+		n = ret / sizeof(recs[0]);
+		pthread_mutex_lock(&lat_lock);
+		for (i = 0; i < n; i++) {
+			sent = __atomic_load_n(&send_ns[recs[i].raw], __ATOMIC_RELAXED);
+			if (!sent || sent > recs[i].timestamp) {
+				lat_unknown++;
+				continue;
+			}
+			lat_add(&lat_driver, recs[i].timestamp - sent);
+			lat_add(&lat_total, now - sent);
+		}
+		pthread_mutex_unlock(&lat_lock);
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void print_lat(const char *name, struct lat_stats *s)
+{
+	if (!s->cnt)
+		return;
+	fprintf(stderr, " | %s %" PRIu64 "/%" PRIu64 "/%" PRIu64 " us",
+		name, s->min / 1000, s->sum / s->cnt / 1000, s->max / 1000);
+}
+
+/*
+ * Print what happened since the last report, over dt ns
+ */
+static void report(uint64_t dt, uint64_t pkts, uint64_t bytes)
+{
+	fprintf(stderr, "%8.0f pkt/s %10.0f B/s",
+		pkts * 1e9 / dt, bytes * 1e9 / dt);
+
+	if (latency_dev) {
+		pthread_mutex_lock(&lat_lock);
+		fprintf(stderr, " | %" PRIu64 " samples read", lat_total.cnt);
+		print_lat("driver min/avg/max", &lat_driver);
+		print_lat("reader", &lat_total);
+		if (lat_unknown)
+			fprintf(stderr, " | %" PRIu64 " unmatched", lat_unknown);
+		memset(&lat_driver, 0, sizeof(lat_driver));
+		memset(&lat_total, 0, sizeof(lat_total));
+		lat_unknown = 0;
+		pthread_mutex_unlock(&lat_lock);
+	}
+	fprintf(stderr, "\n");
+}
+
+static void sig_catch(int sig)
+{
+	stop = 1;
+}
+
+/*
+ * Send packets at the configured rate until told to stop,
+ * batching those that are due into a single write().
+ */
+static void run(void)
+{
+	int len;
+	uint64_t start, now, due, last, last_pkts, last_bytes;
+	size_t fill;
+	unsigned char *pkt;
+	unsigned char buf[WRITE_BUFSZ + MAX_ESCAPED_LEN];
+	struct timespec ts;
+
+	start = last = now_ns();
+	last_pkts = last_bytes = 0;
+
+	while (!stop) {
+		now = now_ns();
+		if (duration && now - start >= duration * 1000000000ULL)
+			break;
+		if (now - last >= 1000000000ULL) {
+			report(now - last, pkts_sent - last_pkts, bytes_sent - last_bytes);
+			last = now;
+			last_pkts = pkts_sent;
+			last_bytes = bytes_sent;
+		}
+
+		due = rate ? (now - start) * rate / 1000000000ULL + 1 : (uint64_t)-1;
+		if (pkts_sent >= due) {
+			/* Sleep until the next packet is due */
+			now = start + (pkts_sent * 1000000000ULL + rate - 1) / rate;
+			ts.tv_sec = now / 1000000000ULL;
+			ts.tv_nsec = now % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			continue;
+		}
+
+		fill = 0;
+		now = now_ns();
+		while (pkts_sent < due && fill < WRITE_BUFSZ) {
+			if (capture) {
+				len = next_captured(&pkt);
+				if (!len) {
+					fprintf(stderr, "%s: no packets found\n", capture);
+					exit(1);
+				}
+				memcpy(buf + fill, pkt, len);
+			} else {
+				len = make_packet(buf + fill, pkts_sent);
+				__atomic_store_n(&send_ns[pkts_sent & 0xffff], now,
+					__ATOMIC_RELAXED);
+			}
+			fill += len;
+			pkts_sent++;
+		}
+		write_all(buf, fill);
+		bytes_sent += fill;
+	}
+
+	now = now_ns();
+	fprintf(stderr, "Total: %" PRIu64 " packets, %" PRIu64 " bytes in %.3f s: ",
+		pkts_sent, bytes_sent, (now - start) / 1e9);
+	report(now - start, pkts_sent, bytes_sent);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int wait = -1;
+	pthread_t reader;
+	struct sigaction sa;
+
+	while ((c = getopt(argc, argv, "n:r:t:f:l:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			nodes = atoi(optarg);
+			if (nodes < 1 || nodes > 65535)		/* 16-bit node ids */
+				usage(argv[0]);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'f':
+			capture = optarg;
+			break;
+		case 'l':
+			latency_dev = optarg;
+			break;
+		case 'w':
+			wait = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+	if (capture && latency_dev) {
+		fprintf(stderr, "Latency can only be measured with synthesized packets\n");
+		exit(1);
+	}
+	if (capture && load_capture(capture) < 0)
+		exit(1);
+
+	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master_fd < 0 || grantpt(master_fd) < 0 || unlockpt(master_fd) < 0) {
+		perror("pseudo-terminal");
+		exit(1);
+	}
+	printf("%s\n", ptsname(master_fd));
+	fflush(stdout);
+
+	if (wait < 0) {
+		fprintf(stderr, "Attach the line discipline to it, then press Enter to start...\n");
+		while ((c = getchar()) != '\n' && c != EOF)
+			;
+	} else
+		sleep(wait);
+
+	/* No SA_RESTART: a write() blocked on a full pty must return */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_catch;
+	(void) sigaction(SIGHUP, &sa, NULL);
+	(void) sigaction(SIGINT, &sa, NULL);
+	(void) sigaction(SIGTERM, &sa, NULL);
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	if (latency_dev && pthread_create(&reader, NULL, latency_reader, NULL)) {
+		fprintf(stderr, "Could not start the latency reader\n");
+		exit(1);
+	}
+
+	run();
+
+	close(master_fd);
+	return 0;
+}
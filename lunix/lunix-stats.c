@@ -0,0 +1,96 @@
+/*
+ * lunix-stats.c
+ *
+ * Receive path counters for Lunix:TNG,
+ * exported through debugfs as lunix/stats
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/err.h>
+
+#include "lunix.h"
+
+/*
+ * Counters are kept per CPU, so that the receive path
+ * never shares a cache line with anyone else to bump them.
+ */
+DEFINE_PER_CPU(struct lunix_stats, lunix_stats);
+
+static const char * const lunix_stat_names[N_LUNIX_STAT] = {
+	[LUNIX_STAT_BYTES]		= "bytes",
+	[LUNIX_STAT_FRAMES]		= "frames",
+	[LUNIX_STAT_CRC_ERRORS]		= "crc_errors",
+	[LUNIX_STAT_FRAMING_ERRORS]	= "framing_errors",
+	[LUNIX_STAT_OVERFLOWS]		= "overflows",
+	[LUNIX_STAT_SKIPPED]		= "skipped",
+	[LUNIX_STAT_DROPPED_NODES]	= "dropped_nodes",
+	[LUNIX_STAT_OVERRUNS]		= "overruns",
+	[LUNIX_STAT_STALLS]		= "stalls",
+	[LUNIX_STAT_THROTTLES]		= "throttles",
+};
+
+static struct dentry *lunix_debugfs_dir;
+
+/*
+ * Sum up the counters of all CPUs
+ */
+void lunix_stats_read(struct lunix_stats *total)
+{
+	int i, cpu;
+
+	memset(total, 0, sizeof(*total));
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < N_LUNIX_STAT; i++)
+			total->v[i] += per_cpu(lunix_stats, cpu).v[i];
+}
+
+static int lunix_stats_show(struct seq_file *m, void *unused)
+{
+	int i;
+	struct lunix_stats total;
+
+	lunix_stats_read(&total);
+	for (i = 0; i < N_LUNIX_STAT; i++)
+		seq_printf(m, "%-16s %lu\n", lunix_stat_names[i], total.v[i]);
+
+	return 0;
+}
+
+static int lunix_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, lunix_stats_show, NULL);
+}
+
+static const struct file_operations lunix_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lunix_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * The counters are diagnostics only: failing to export
+ * them does not keep the module from loading.
+ */
+void lunix_stats_init(void)
+{
+	lunix_debugfs_dir = debugfs_create_dir("lunix", NULL);
+	if (IS_ERR_OR_NULL(lunix_debugfs_dir)) {
+		lunix_debugfs_dir = NULL;
+		return;
+	}
+	debugfs_create_file("stats", 0444, lunix_debugfs_dir, NULL, &lunix_stats_fops);
+}
+
+void lunix_stats_destroy(void)
+{
+	debugfs_remove_recursive(lunix_debugfs_dir);
+}
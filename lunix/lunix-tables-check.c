@@ -0,0 +1,90 @@
+/*
+ * lunix-tables-check.c
+ *
+ * Checks the lookup tables in lunix-tables.h, as generated by
+ * mk_lookup_tables, against the exact conversion formulas, in
+ * floating point. Reports the maximum error of each table, in
+ * thousandths of the unit, and the raw value it occurs at.
+ *
+ * Table entries are the exact values truncated to whole thousandths,
+ * so every entry must be within one thousandth of the exact value.
+ * Exits with 1 if one is not.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "lunix-tables.h"
+
+#define ADC_FS		1023.0
+
+/*
+ * Battery voltage, against a reference of 1.223 V, in mV
+ */
+static double exact_batt(unsigned int raw)
+{
+	return 1.223 * (ADC_FS / raw) * 1000;
+}
+
+/*
+ * Thermistor temperature, with 1/T = a + b ln(R) + c ln(R)^3,
+ * in series with 10 kOhm, in thousandths of a degree Celsius.
+ * Clamped at the same lower bound as mk_lookup_tables.c.
+ */
+static double exact_temp(unsigned int raw)
+{
+	double R1 = 10000.0;
+	double a = 0.001010024;
+	double b = 0.000242127;
+	double c = 0.000000146;
+	double Rth, Kelvin_Inv, res;
+
+	Rth = (R1 * (ADC_FS - raw)) / raw;
+	Kelvin_Inv = a + b * log(Rth) + c * pow(log(Rth), 3);
+	res = ((1.0 / Kelvin_Inv) - 272.15) * 1000;
+
+	return (res < -272150) ? -272150 : res;
+}
+
+/*
+ * Compare a table with a formula over the whole ADC range. Raw values
+ * the formula has no finite value for are skipped, and counted.
+ * Returns 1 if the table is accurate to within one thousandth.
+ */
+static int check(const char *name, const int32_t *table, double (*exact)(unsigned int))
+{
+	unsigned int raw, worst, skipped;
+	double err, max_err;
+
+	max_err = 0;
+	worst = 0;
+	skipped = 0;
+	for (raw = 0; raw < LUNIX_ADC_RANGE; raw++) {
+		if (!isfinite(exact(raw))) {
+			skipped++;
+			continue;
+		}
+		err = fabs(table[raw] - exact(raw));
+		if (err > max_err) {
+			max_err = err;
+			worst = raw;
+		}
+	}
+
+	printf("%-12s max error %.6f thousandths at raw %4u [table %" PRId32 ", exact %.6f], %u skipped\n",
+		name, max_err, worst, table[worst], exact(worst), skipped);
+
+	return max_err < 1.0;
+}
+
+int main(void)
+{
+	int ok;
+
+	ok = check("temperature", lookup_temperature, exact_temp);
+	ok &= check("voltage", lookup_voltage, exact_batt);
+
+	return ok ? 0 : 1;
+}
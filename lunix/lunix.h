@@ -19,18 +19,45 @@
 #include <linux/tty.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 
 /*
  * A structure representing a hardware sensor
  * and pages holding the most recent measurements received
  */
 
-#define LUNIX_MSR_MAGIC 0xF00DF00D
-
-enum lunix_data_parse_mode { RAW, COOKED, BASIC};
 enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
 
+/*
+ * A calibration table uploaded for a measurement of a sensor
+ * [see struct lunix_calib in lunix-chrdev.h], freed through RCU
+ */
+struct lunix_calib_table {
+	struct rcu_head rcu;
+	uint32_t cnt;
+	uint32_t shift;
+	int32_t table[];
+};
+
+/*
+ * Packets other than sensor readings, kept per node as received:
+ * mesh health [AM type 0x03] and routing [AM type 0xFD] packets.
+ */
+enum lunix_msg_enum { HEALTH = 0, ROUTE, N_LUNIX_MSG };
+
+#define LUNIX_MSG_MAXLEN	255
+
+struct lunix_msg_data_struct {
+	uint32_t seq;		/* as in struct lunix_msr_data_struct */
+	uint32_t serial;	/* number of packets received so far */
+	uint32_t len;		/* length of the payload */
+	unsigned char payload[LUNIX_MSG_MAXLEN];
+};
+
 struct lunix_sensor_struct {
+	uint16_t nodeid;
+
 	/*
 	 * A number of pages, one for each measurement.
 	 * They can be mapped to userspace.
@@ -38,25 +65,83 @@ struct lunix_sensor_struct {
 	struct lunix_msr_data_struct *msr_data[N_LUNIX_MSR];
 
 	/*
-	 * Spinlock used to assert mutual exclusion between
-	 * the serial line discipline and the character device driver
+	 * Spinlock serializing updates of the measurement pages.
+	 * Readers never take it, they use the seq count in each
+	 * page instead [see lunix_msr_read_begin()].
 	 */
 	spinlock_t lock;
 
 	/*
-	 * A list of processes waiting to be woken up
-	 * when this sensor has been updated with new data
+	 * The latest packet of every other kind received from the node.
+	 * Updates are serialized by the spinlock above, readers use the
+	 * seq count in each buffer, as for the measurement pages.
+	 */
+	struct lunix_msg_data_struct *msg_data[N_LUNIX_MSG];
+
+	/*
+	 * The gateway the latest packet from the node came through [the
+	 * id of its TTY, see lunix-ldisc.c; 0 if none yet], and whether it
+	 * has been detached since, also protected by the spinlock. Readers
+	 * of a disconnected sensor get EOF once they have read everything,
+	 * until a packet arrives again.
+	 */
+	unsigned long gateway;
+	int disconnected;
+
+	/*
+	 * Calibration of each measurement, or NULL for the built-in
+	 * conversion. Read under RCU when converting new values, so
+	 * that swapping tables never holds up the receive path.
+	 */
+	struct lunix_calib_table __rcu *calib[N_LUNIX_MSR];
+
+	/*
+	 * Lists of processes waiting to be woken up: wq for readers of
+	 * the measurements, msg_wq for readers of each other kind of
+	 * packet. Every sensor packet updates all of the measurements,
+	 * so all of their readers share wq; their filters decide who
+	 * actually runs [see lunix_chrdev_wake_function()].
 	 */
 	wait_queue_head_t wq;
+	wait_queue_head_t msg_wq[N_LUNIX_MSG];
 };
 
 /*
- * The default value for the maximum number of sensors supported
+ * Sensors are created on demand, the first time a packet from a node
+ * is received or one of its device nodes is opened [by the administrator,
+ * others get -ENODEV until the node has been heard from]. Node ids go from
+ * 1 to LUNIX_MAX_NODES; lunix_sensor_cnt caps the number of sensors
+ * kept track of at any time, and defaults to LUNIX_SENSOR_CNT.
  */
-#define LUNIX_SENSOR_CNT			16
+#define LUNIX_MAX_NODES				65535
+#define LUNIX_SENSOR_CNT			4096
 extern int lunix_sensor_cnt;
-extern struct lunix_sensor_struct *lunix_sensors;
-extern struct lunix_protocol_state_struct lunix_protocol_state;
+
+/*
+ * Receive path counters, kept per CPU [lunix-stats.c]
+ */
+enum lunix_stat_enum {
+	LUNIX_STAT_BYTES = 0,		/* bytes received from the TTY */
+	LUNIX_STAT_FRAMES,		/* packets received intact */
+	LUNIX_STAT_CRC_ERRORS,		/* packets dropped for a bad CRC */
+	LUNIX_STAT_FRAMING_ERRORS,	/* packets cut short, missing their end byte, or too short */
+	LUNIX_STAT_OVERFLOWS,		/* packets longer than MAX_PACKET_LEN */
+	LUNIX_STAT_SKIPPED,		/* bytes skipped while seeking a start byte */
+	LUNIX_STAT_DROPPED_NODES,	/* packets from nodes no sensor could be created for */
+	LUNIX_STAT_OVERRUNS,		/* bytes lost by the TTY driver [TTY_OVERRUN] */
+	LUNIX_STAT_STALLS,		/* times data were held back in the TTY layer for lack of room */
+	LUNIX_STAT_THROTTLES,		/* times the TTY was throttled */
+	N_LUNIX_STAT
+};
+
+struct lunix_stats {
+	unsigned long v[N_LUNIX_STAT];
+};
+
+DECLARE_PER_CPU(struct lunix_stats, lunix_stats);
+
+#define lunix_stat_inc(stat)		this_cpu_inc(lunix_stats.v[stat])
+#define lunix_stat_add(stat, n)		this_cpu_add(lunix_stats.v[stat], n)
 
 /*
  * Debugging
@@ -71,25 +156,157 @@ extern struct lunix_protocol_state_struct lunix_protocol_state;
 /*
  * Function prototypes
  */
-int lunix_sensor_init(struct lunix_sensor_struct *);
-void lunix_sensor_destroy(struct lunix_sensor_struct *);
+struct lunix_msr_stats;
+
+struct lunix_sensor_struct *lunix_sensor_lookup(uint16_t nodeid);
+struct lunix_sensor_struct *lunix_sensor_get(uint16_t nodeid);
+unsigned int lunix_sensor_gang_lookup(struct lunix_sensor_struct **sensors,
+	uint16_t first, unsigned int max);
+void lunix_sensor_destroy_all(void);
+void lunix_sensor_link(struct lunix_sensor_struct *s, unsigned long gateway);
+void lunix_sensor_disconnect(unsigned long gateway, int last);
+void lunix_sensor_set_calib(struct lunix_sensor_struct *s,
+	enum lunix_msr_enum type, struct lunix_calib_table *calib);
+void lunix_stats_init(void);
+void lunix_stats_destroy(void);
+void lunix_stats_read(struct lunix_stats *total);
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light);
+void lunix_sensor_read_stats(struct lunix_sensor_struct *s,
+	enum lunix_msr_enum type, struct lunix_msr_stats *stats, int reset);
+void lunix_sensor_store_msg(struct lunix_sensor_struct *s,
+	enum lunix_msg_enum type, const unsigned char *payload, int len);
+int lunix_sensor_read_msg(struct lunix_sensor_struct *s,
+	enum lunix_msg_enum type, unsigned char *payload, uint32_t *serial);
 
 #else
 #include <inttypes.h>
 #endif	/* __KERNEL__ */
+
+/*
+ * Read modes of a character device node
+ */
+enum lunix_data_parse_mode { RAW, COOKED, BASIC, STAMPED, BINARY };
+
+/*
+ * Number of past samples kept in each measurement page.
+ * Must be a power of two.
+ */
+#define LUNIX_MSR_RING_LEN	128
+
+/*
+ * A single sample. Samples are numbered by a serial, starting from 1
+ * and incremented on every update of the measurement. The timestamp
+ * is in nanoseconds, taken from the monotonic clock [ktime_get_ns()].
+ * value is the raw measurement, cooked the same converted to thousandths
+ * of the unit, once for all readers.
+ */
+struct lunix_msr_sample {
+	uint64_t timestamp;
+	uint32_t serial;
+	uint32_t value;
+	int32_t cooked;
+	uint32_t __pad;
+};
+
+/*
+ * Running statistics of a measurement, updated on every sample since the
+ * last reset, on converted values [thousandths of the unit]. sum / count
+ * gives the mean. ewma is an exponentially weighted moving average with a
+ * weight of 1 / 2^LUNIX_EWMA_WEIGHT for each new sample, in fixed point
+ * with LUNIX_EWMA_FRAC fractional bits.
+ */
+#define LUNIX_EWMA_WEIGHT	3
+#define LUNIX_EWMA_FRAC		8
+
+struct lunix_msr_stats {
+	uint64_t count;
+	int64_t sum;
+	int64_t ewma;
+	int32_t min;
+	int32_t max;
+};
+
 /*
  * A structure, living at the start of a page, containing a version number
  * [timestamp of last update] and a variable number of 32-bit quantities. It is
- * meant to be mappable to userspace.
+ * meant to be mappable to userspace, and its layout is therefore ABI: every
+ * member has a fixed size and explicit padding, and nothing private to the
+ * kernel lives in the page. magic and version come first and never move.
+ * Mappers must check both: version is bumped on any change to the layout.
+ *
+ * seq works like the sequence count of a seqlock: the writer makes it odd
+ * before touching the page and even again once the update is complete.
+ * A lockless reader (e.g. one that has mmap()ed the page) samples seq,
+ * retries while it is odd, reads the values and then checks that seq has
+ * not changed in the meantime:
+ *
+ *	do {
+ *		while ((seq = msr->seq) & 1)
+ *			;
+ *		rmb();
+ *		value = msr->values[0];
+ *		stamp = msr->timestamp;
+ *		rmb();
+ *	} while (msr->seq != seq);
+ *
+ * last_update is the wall clock time of the last update, in seconds;
+ * timestamp is the monotonic time of the last update, in nanoseconds.
+ * cooked is values[0] converted to thousandths of the unit.
+ *
+ * The page also holds a ring of the most recent samples. head counts the
+ * samples stored so far, and is therefore also the serial of the latest
+ * one; serials start at 1. Sample n lives in
+ * ring[(n - 1) % LUNIX_MSR_RING_LEN], so the latest one is in
+ * ring[(head - 1) % LUNIX_MSR_RING_LEN], and the oldest one still
+ * available is head - LUNIX_MSR_RING_LEN + 1. The ring is read under the
+ * same seq protocol, and so are the statistics.
  */
+#define LUNIX_MSR_MAGIC		0xF00DF00D
+#define LUNIX_MSR_VERSION	1
+
 struct lunix_msr_data_struct {
-	uint32_t magic;
+	uint32_t magic;		/* LUNIX_MSR_MAGIC */
+	uint32_t version;	/* LUNIX_MSR_VERSION */
+	uint32_t seq;
+	uint32_t head;
+	uint64_t timestamp;
 	uint32_t last_update;
-	uint32_t values[];
+	uint32_t values[1];
+	int32_t cooked;
+	uint32_t __pad;
+	struct lunix_msr_stats stats;
+	struct lunix_msr_sample ring[LUNIX_MSR_RING_LEN];
 };
 
+#ifdef __KERNEL__
+/*
+ * Lockless readers of a measurement page:
+ *
+ *	do {
+ *		seq = lunix_msr_read_begin(msr);
+ *		...
+ *	} while (lunix_msr_read_retry(msr, seq));
+ */
+static inline uint32_t lunix_msr_read_begin(const struct lunix_msr_data_struct *msr)
+{
+	uint32_t seq;
+
+	while ((seq = READ_ONCE(msr->seq)) & 1)
+		cpu_relax();
+	smp_rmb();
+
+	return seq;
+}
+
+static inline int lunix_msr_read_retry(const struct lunix_msr_data_struct *msr,
+	uint32_t seq)
+{
+	smp_rmb();
+	return READ_ONCE(msr->seq) != seq;
+}
+#endif	/* __KERNEL__ */
+
 /*
  * Lunix:TNG line discipline number:
  * Hijack the "Mobitex module" line discipline, since the number
@@ -9,13 +9,18 @@ grep -q '^kvm:' /etc/group || group="wheel"
 # Make sure the node for the first serial port is there.
 mknod /dev/ttyS0 c 4 64
 
-# Lunix:TNG nodes: 16 sensors, each has 3 nodes.
+# Lunix:TNG nodes: 16 sensors, each has 3 measurement nodes,
+# plus one for mesh health and one for routing packets.
+# The node with id N uses minors (N - 1) * 8 to (N - 1) * 8 + 4,
+# for any N up to 65535.
 for sensor in $(seq 0 1 15); do
 	mknod /dev/lunix$sensor-batt c 60 $[$sensor * 8 + 0]
 	mknod /dev/lunix$sensor-temp c 60 $[$sensor * 8 + 1]
 	mknod /dev/lunix$sensor-light c 60 $[$sensor * 8 + 2]
+	mknod /dev/lunix$sensor-health c 60 $[$sensor * 8 + 3]
+	mknod /dev/lunix$sensor-route c 60 $[$sensor * 8 + 4]
 done
 
 # setting permissions
-chgrp $group /dev/lunix${sensor}-{batt,temp,light}
-chmod $mode  /dev/lunix${sensor}-{batt,temp,light}
+chgrp $group /dev/lunix${sensor}-{batt,temp,light,health,route}
+chmod $mode  /dev/lunix${sensor}-{batt,temp,light,health,route}
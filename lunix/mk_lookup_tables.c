@@ -2,8 +2,9 @@
  * mk_lookup_tables.c
  *
  * Computes the temperature and battery
- * lookup tables for converting 16-bit raw measurements
- * from the wireless sensors to actual floating point values.
+ * lookup tables for converting 10-bit raw measurements
+ * from the wireless sensors to actual floating point values,
+ * and writes them to stdout.
  *
  * Ioannis Panagopoulos <ioannis@cslab.ece.ntua.gr>
  * Vangelis Koukis <vkoukis@cslab.ece.ntua.gr>
@@ -29,15 +30,6 @@ long uint16_to_batt(uint16_t value)
 	return (long)(d * 1000);
 }
 
-/*
- * Translates the received uint16_t value to light level
- * (NOT YET IMPLEMENTED, just does a linear conversion)
- */
-long uint16_to_light(uint16_t value)
-{
-	return (long) (value * 5000000.0 / 65535);
-}
-
 /*
  * Translates the received uint16_t value to temperature level
  */
@@ -50,9 +42,9 @@ long uint16_to_temp(uint16_t value)
 
 	double Rth, Kelvin_Inv;
 
-	double a = 0.001010024F;
-	double b = 0.000242127F;
-	double c = 0.000000146F;
+	double a = 0.001010024;
+	double b = 0.000242127;
+	double c = 0.000000146;
 	
 	double res;
 	 
@@ -66,65 +58,53 @@ long uint16_to_temp(uint16_t value)
 	return (l < -272150) ?  -272150 : l;
 }
 
-int main(void)
+/*
+ * The sensors report 10-bit ADC values for temperature and battery
+ * voltage, so LUNIX_ADC_RANGE entries per table are enough. Light is
+ * a linear conversion over the full 16-bit range, done arithmetically
+ * in the kernel instead.
+ */
+#define LUNIX_ADC_RANGE	1024
+
+static void print_table(const char *name, long (*conv)(uint16_t))
 {
 	unsigned int i;
 
-	fprintf(stdout,
-		"/*\n"
+	printf("static const int32_t %s[LUNIX_ADC_RANGE] = {\n", name);
+	for (i = 0; i < LUNIX_ADC_RANGE; i += 4)
+		printf("\t%ld, %ld, %ld, %ld%s\n",
+			conv(i), conv(i + 1), conv(i + 2), conv(i + 3),
+			(i != LUNIX_ADC_RANGE - 4) ? "," : "");
+	printf("};\n\n");
+}
+
+int main(void)
+{
+	printf("/*\n"
 		" * lunix-tables.h\n"
 		" *\n"
 		" * Machine-generated file. DO NOT EDIT.\n"
 		" * See %s instead.\n"
 		" *\n"
 		" * Instead of doing floating-point in kernelspace,\n"
-		" * use the following lookup tables to convert 16-bit\n"
-		" * raw measurements to floating point values.\n"
+		" * use the following lookup tables to convert 10-bit\n"
+		" * raw measurements to thousandths of the unit.\n"
+		" * Raw values above LUNIX_ADC_MAX must be clamped.\n"
 		" */\n"
-		"\n", __FILE__);
+		"\n"
+		"#define LUNIX_ADC_RANGE\t%d\n"
+		"#define LUNIX_ADC_MAX\t(LUNIX_ADC_RANGE - 1)\n"
+		"\n", __FILE__, LUNIX_ADC_RANGE);
 
-	FILE *fd = fopen("lunix-tables.h", "w");
-	if (!fd) { return -1; }
-	
 	/*
 	 * Temperature
 	 */
-    fprintf(fd, "long lookup_temperature[65536] = {\n");
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(fd, "\t%ld, %ld, %ld, %ld",
-			uint16_to_temp(i), uint16_to_temp(i+1),
-			uint16_to_temp(i+2), uint16_to_temp(i+3));
-		fprintf(fd, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-
-	fprintf(fd, "};\n\n"
-		"long lookup_voltage[65536] = {\n");
+	print_table("lookup_temperature", uint16_to_temp);
 
 	/*
 	 * Battery Voltage
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(fd, "\t%ld, %ld, %ld, %ld",
-			uint16_to_batt(i), uint16_to_batt(i+1),
-			uint16_to_batt(i+2), uint16_to_batt(i+3));
-		fprintf(fd, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-	fprintf(fd, "};\n\n"
-		"long lookup_light[65536] = {\n");
-
-	/*
-	 * Light
-	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(fd, "\t%ld, %ld, %ld, %ld",
-			uint16_to_light(i), uint16_to_light(i+1),
-			uint16_to_light(i+2), uint16_to_light(i+3));
-		fprintf(fd, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-
-	fprintf(fd, "};\n\n");
+	print_table("lookup_voltage", uint16_to_batt);
 
-	fflush(fd);
-	fclose(fd);
 	return 0;
 }